@@ -0,0 +1,75 @@
+'use strict'
+/*
+  Writes the same records three ways (plain, compressed without a
+  trained dictionary, compressed with one) and reports the size of
+  each file, how many records were stored compressed and how long it
+  takes to read every record back. Records are about 240 bytes, so
+  the minimum length to compress is set well under that.
+*/
+
+const binary = require('node-pre-gyp')
+const path = require('path')
+const mmapObjPath = binary.find(path.resolve(path.join(__dirname, '../package.json')))
+const MmapObject = require(mmapObjPath)
+const temp = require('temp')
+const fs = require('fs')
+
+const Records = 100000
+const Threshold = 64
+const Countries = ['US', 'DE', 'FR', 'JP', 'BR', 'IN', 'GB', 'CA']
+const Statuses = ['active', 'suspended', 'pending', 'closed']
+
+function record (i) {
+  return JSON.stringify({
+    id: i,
+    name: `customer number ${i}`,
+    country: Countries[i % Countries.length],
+    status: Statuses[i % Statuses.length],
+    created: new Date(1500000000000 + i * 60000).toISOString(),
+    notes: 'Account opened through the partner program. Billing contact confirmed by phone.',
+    tags: ['retail', 'newsletter', i % 3 ? 'priority' : 'standard']
+  })
+}
+
+function build (filename, options, train) {
+  const obj = new MmapObject.Create(filename, options)
+  for (let i = 0; i < Records; i++) {
+    obj[`key${i}`] = record(i)
+    if (train && i === 1000) {
+      obj.compress()
+    }
+  }
+  obj.close()
+}
+
+function read (filename) {
+  const obj = new MmapObject.Open(filename)
+  const start = process.hrtime()
+  let length = 0
+  for (let i = 0; i < Records; i++) {
+    length += obj[`key${i}`].length
+  }
+  const elapsed = process.hrtime(start)
+  const compressed = obj.compressed_count()
+  obj.close()
+  return { ms: elapsed[0] * 1e3 + elapsed[1] / 1e6, length: length, compressed: compressed }
+}
+
+temp.track()
+const dir = temp.mkdirSync('mmap-bench')
+const runs = [
+  ['plain', {}, false],
+  ['compressed', { compress: Threshold }, false],
+  ['compressed, trained', { compress: Threshold }, true]
+]
+for (const [name, options, train] of runs) {
+  for (const format of ['hash', 'flat']) {
+    const filename = path.join(dir, `${format}-${name}`)
+    build(filename, Object.assign({ format: format }, options), train)
+    const result = read(filename)
+    const size = fs.statSync(filename).size
+    console.log(`${format} ${name}: ${size} bytes on disk, ` +
+                `${result.compressed} of ${Records} records compressed, ` +
+                `read them in ${result.ms.toFixed(0)} ms`)
+  }
+}
@@ -40,7 +40,7 @@
   "targets": [
     {
       "target_name": "<(module_name)",
-      "sources": [ "mmap-object.cc", "cell.cc" ],
+      "sources": [ "mmap-object.cc", "cell.cc", "flat_table.cc", "intern.cc", "compress.cc", "record_stream.cc" ],
       "cflags_cc": [ "<@(cflags_cc)" ],
       "include_dirs": [ "<@(include_dirs)" ],
       "libraries": [ "<@(libraries)" ],
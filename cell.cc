@@ -1,13 +1,29 @@
 #include "cell.hpp"
+#include "intern.hpp"
+#include "compress.hpp"
 #include "common.hpp"
 
 // Avoid freeing shared memory
 static void NullFreer(char *, void *) {}
 
+char Cell::value_type() {
+  if (cell_type == SHARED_TYPE)
+    return cell_value.shared_value.value->type;
+  return cell_type;
+}
+
 const char *Cell::c_str() {
+  if (cell_type == SHARED_TYPE)
+    return cell_value.shared_value.value->data();
   return cell_value.string_value.c_str();
 }
 
+shared_string::size_type Cell::length() {
+  if (cell_type == SHARED_TYPE)
+    return cell_value.shared_value.value->length;
+  return cell_value.string_value.length();
+}
+
 Cell::operator double() {
   if (type() != NUMBER_TYPE)
     throw WrongPropertyType();
@@ -19,47 +35,132 @@ Cell::Cell(const Cell &cell) {
   switch (cell_type) {
   case STRING_TYPE:
   case BUFFER_TYPE:
+  case COMPRESSED_TYPE:
+  case TOMBSTONE_TYPE:
     new (&cell_value.string_value)(shared_string)(cell.cell_value.string_value);
     break;
   case NUMBER_TYPE:
     cell_value.number_value = cell.cell_value.number_value;
     break;
+  case SHARED_TYPE:
+    new (&cell_value.shared_value)(SharedRef)(cell.cell_value.shared_value);
+    cell_value.shared_value.table->retain(cell_value.shared_value.value.get());
+    break;
   default:
     throw WrongPropertyType();
   }
 }
 
-v8::Local<v8::Value> Cell::GetValue() {
+void Cell::clear() {
+  switch (cell_type) {
+  case STRING_TYPE:
+  case BUFFER_TYPE:
+  case COMPRESSED_TYPE:
+  case TOMBSTONE_TYPE:
+    cell_value.string_value.~shared_string();
+    break;
+  case SHARED_TYPE:
+    cell_value.shared_value.table->release(cell_value.shared_value.value.get());
+    cell_value.shared_value.~SharedRef();
+    break;
+  }
+  cell_type = UNINITIALIZED;
+}
+
+// Swap a long string, buffer or compressed value for a reference to a
+// shared copy of it. Return whether the cell changed.
+bool Cell::Share(InternTable *interned) {
+  if ((cell_type != STRING_TYPE && cell_type != BUFFER_TYPE && cell_type != COMPRESSED_TYPE) ||
+      length() < DEDUP_MIN_LENGTH)
+    return false;
+  SharedValue *shared = interned->intern(cell_type, c_str(), length());
+  clear();
+  cell_type = SHARED_TYPE;
+  new (&cell_value.shared_value)(SharedRef){shared, interned};
+  return true;
+}
+
+// Give the cell a new string, buffer or compressed value, shared
+// through interned if it's given. The new value is fully in place in
+// the segment before the old one is let go, so running out of room
+// leaves the cell as it was.
+void Cell::Replace(char type, const char *value, size_t length, segment_manager_t *segment_manager,
+                   InternTable *interned) {
+  if (interned != NULL && length >= DEDUP_MIN_LENGTH) {
+    SharedValue *shared = interned->intern(type, value, length);
+    clear();
+    cell_type = SHARED_TYPE;
+    new (&cell_value.shared_value)(SharedRef){shared, interned};
+    return;
+  }
+  shared_string replacement(value, length, char_allocator(segment_manager));
+  clear();
+  cell_type = type;
+  new (&cell_value.string_value)(shared_string)(boost::move(replacement));
+}
+
+// A buffer held in a SharedValue is copied when the object is
+// writable, since writing through a view of it would change every
+// property sharing it.
+v8::Local<v8::Value> Cell::GetValue(const Compressor *compressor, bool writable) {
   v8::Local<v8::Value> v;
-  switch (type()) {
+  switch (value_type()) {
   case STRING_TYPE:
-    v = Nan::New<v8::String>(c_str()).ToLocalChecked();
+    v = Nan::New<v8::String>(c_str(), length()).ToLocalChecked();
     break;
   case BUFFER_TYPE:
-    v = Nan::NewBuffer(const_cast<char*>(c_str()), length(), NullFreer, NULL).ToLocalChecked();
+    if (writable && cell_type == SHARED_TYPE)
+      v = Nan::CopyBuffer(c_str(), length()).ToLocalChecked();
+    else
+      v = Nan::NewBuffer(const_cast<char*>(c_str()), length(), NullFreer, NULL).ToLocalChecked();
     break;
   case NUMBER_TYPE:
     v = Nan::New<v8::Number>(*this);
     break;
+  case COMPRESSED_TYPE:
+    if (compressor == NULL) {
+      Nan::ThrowError("Compressed value in a file without compression settings.");
+      break;
+    }
+    v = compressor->GetValue(c_str(), length());
+    break;
   default:
     ostringstream error_stream;
-    error_stream << "Unknown cell data type " << dec << (int) type();
+    error_stream << "Unknown cell data type " << dec << (int) value_type();
     Nan::ThrowError(error_stream.str().c_str());
   }
   return v;
 }
 
+// A new cell holding a string or buffer, compressed if compressor is
+// given and the value is long enough, and shared through interned if
+// that's given.
+Cell *Cell::Make(char type, const char *value, size_t length, bip::managed_mapped_file *segment,
+                 InternTable *interned, const Compressor *compressor) {
+  string compressed;
+  if (compressor != NULL && compressor->compress(type, value, length, compressed)) {
+    type = COMPRESSED_TYPE;
+    value = compressed.data();
+    length = compressed.size();
+  }
+  if (interned != NULL && length >= DEDUP_MIN_LENGTH)
+    return new Cell(interned->intern(type, value, length), interned);
+  char_allocator allocer(segment->get_segment_manager());
+  return new Cell(type, value, length, allocer);
+}
+
 // Create a new cell to wrap the given value with, reset the given
 // unique_ptr to that cell. Return the length of the data stored for
 // the caller's accounting.
-size_t Cell::SetValue(v8::Local<v8::Value> value, bip::managed_mapped_file *segment,
-                      unique_ptr<Cell> &c, const Nan::PropertyCallbackInfo<v8::Value>& info) {
+size_t Cell::SetValue(v8::Local<v8::Value> value, bip::managed_mapped_file *segment, InternTable *interned,
+                      const Compressor *compressor, unique_ptr<Cell> &c,
+                      const Nan::PropertyCallbackInfo<v8::Value>& info) {
   size_t length;
   if (value->IsString()) {
     v8::String::Utf8Value data UTF8VALUE(value);
     length = data.length();
-    char_allocator allocer(segment->get_segment_manager());
-    c.reset(new Cell(string(*data).c_str(), allocer));
+    string str(*data);
+    c.reset(Make(STRING_TYPE, str.c_str(), str.length(), segment, interned, compressor));
   } else if (value->IsNumber()) {
     length = sizeof(double);
     c.reset(new Cell(Nan::To<double>(value).FromJust()));
@@ -68,8 +169,7 @@ size_t Cell::SetValue(v8::Local<v8::Value> value, bip::managed_mapped_file *segm
     char* bufData = node::Buffer::Data(buf);
     size_t bufLen = node::Buffer::Length(buf);
     length = bufLen;
-    char_allocator allocer(segment->get_segment_manager());
-    c.reset(new Cell(bufData, bufLen, allocer));
+    c.reset(Make(BUFFER_TYPE, bufData, bufLen, segment, interned, compressor));
   } else {
     Nan::ThrowError("Value must be a string, buffer, or number.");
     return -1;
@@ -1,3 +1,4 @@
+#pragma once
 #include <boost/interprocess/managed_mapped_file.hpp>
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/interprocess/containers/string.hpp>
@@ -21,6 +22,28 @@ typedef bip::basic_string<char, char_traits<char>, char_allocator> shared_string
 #define STRING_TYPE 1
 #define NUMBER_TYPE 2
 #define BUFFER_TYPE 3
+#define SHARED_TYPE 4 // A string or buffer held in a SharedValue
+#define COMPRESSED_TYPE 5 // A string or buffer, compressed by a Compressor
+#define TOMBSTONE_TYPE 6 // A key deleted in an overlay, masking the base's value
+
+// A value stored once and referenced from any number of cells or
+// slots. The data follows the header.
+struct SharedValue {
+  uint64_t refcount;
+  uint64_t hash;
+  uint64_t length;
+  char type; // STRING_TYPE, BUFFER_TYPE or COMPRESSED_TYPE
+  char *data() { return reinterpret_cast<char *>(this + 1); }
+  const char *data() const { return reinterpret_cast<const char *>(this + 1); }
+};
+
+class InternTable;
+class Compressor;
+
+struct SharedRef {
+  bip::offset_ptr<SharedValue> value;
+  bip::offset_ptr<InternTable> table;
+};
 
 class Cell {
 private:
@@ -28,27 +51,38 @@ private:
   union values {
     shared_string string_value;
     double number_value;
+    SharedRef shared_value;
     values(const char *value, const shared_string::size_type len, char_allocator allocator): string_value(value, len, allocator) {}
     values(const char *value, char_allocator allocator): string_value(value, allocator) {}
     values(const double value): number_value(value) {}
+    values(SharedValue *value, InternTable *table) : shared_value{value, table} {}
     values() {}
     ~values() {}
   } cell_value;
+  void clear();
 public:
   Cell(const char *value, const shared_string::size_type len, char_allocator allocator) : cell_type(BUFFER_TYPE), cell_value(value, len, allocator) {}
+  Cell(char type, const char *value, const shared_string::size_type len, char_allocator allocator) : cell_type(type), cell_value(value, len, allocator) {}
   Cell(const char *value, char_allocator allocator) : cell_type(STRING_TYPE), cell_value(value, allocator) {}
   explicit Cell(const double value) : cell_type(NUMBER_TYPE), cell_value(value) {}
+  // Takes over a reference already held on value.
+  Cell(SharedValue *value, InternTable *table) : cell_type(SHARED_TYPE), cell_value(value, table) {}
   Cell(const Cell &cell);
-  ~Cell() {
-    if (cell_type == STRING_TYPE || cell_type == BUFFER_TYPE)
-      cell_value.string_value.~shared_string();
-  }
+  ~Cell() { clear(); }
   char type() { return cell_type; }
-  shared_string::size_type length() { return cell_value.string_value.length(); }
+  char value_type(); // The type of what's held in a shared cell
+  shared_string::size_type length();
   const char *c_str();
   operator double();
-  v8::Local<v8::Value> GetValue(); 
-  static size_t SetValue(v8::Local<v8::Value> value, bip::managed_mapped_file *segment, unique_ptr<Cell> &c, const Nan::PropertyCallbackInfo<v8::Value>& info);
+  v8::Local<v8::Value> GetValue(const Compressor *compressor, bool writable);
+  bool Share(InternTable *interned);
+  void Replace(char type, const char *value, size_t length, segment_manager_t *segment_manager,
+               InternTable *interned);
+  static Cell *Make(char type, const char *value, size_t length, bip::managed_mapped_file *segment,
+                    InternTable *interned, const Compressor *compressor);
+  static size_t SetValue(v8::Local<v8::Value> value, bip::managed_mapped_file *segment, InternTable *interned,
+                         const Compressor *compressor, unique_ptr<Cell> &c,
+                         const Nan::PropertyCallbackInfo<v8::Value>& info);
 };
 
 class WrongPropertyType: public exception {};
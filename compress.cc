@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <queue>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include "compress.hpp"
+#include "flat_table.hpp"
+#include "common.hpp"
+
+#define TRAINING_PIECE 64 // Dictionaries are built from pieces of samples this long
+#define TRAINING_SHINGLE 8
+
+void Compressor::add_dictionary(const string &dictionary) {
+  dictionaries.push_back(shared_string(dictionary.data(), dictionary.size(), dictionaries.get_allocator()));
+}
+
+bool Compressor::compress(char type, const char *data, size_t length, string &out) const {
+  if (length < threshold)
+    return false;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // Raw deflate: the header says everything a zlib wrapper would.
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  CompressedHeader header;
+  memset(&header, 0, sizeof(header));
+  header.length = length;
+  header.dictionary = current();
+  header.type = type;
+  const shared_string *dict = dictionary(header.dictionary);
+  if (dict != NULL)
+    deflateSetDictionary(&stream, reinterpret_cast<const Bytef *>(dict->data()), dict->size());
+
+  string blob(sizeof(header) + deflateBound(&stream, length), '\0');
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+  stream.avail_in = length;
+  stream.next_out = reinterpret_cast<Bytef *>(&blob[sizeof(header)]);
+  stream.avail_out = blob.size() - sizeof(header);
+  int result = deflate(&stream, Z_FINISH);
+  size_t compressed = stream.total_out;
+  deflateEnd(&stream);
+  if (result != Z_STREAM_END || sizeof(header) + compressed >= length)
+    return false;
+  memcpy(&blob[0], &header, sizeof(header));
+  blob.resize(sizeof(header) + compressed);
+  out.swap(blob);
+  return true;
+}
+
+// Decompress into out, which must hold the header's length. Doesn't
+// touch anything but its arguments, so it's safe off the main thread.
+bool Compressor::Inflate(const char *blob, size_t length, const char *dictionary, size_t dictionary_length,
+                         char *out) {
+  CompressedHeader header;
+  memcpy(&header, blob, sizeof(header));
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, -15) != Z_OK)
+    return false;
+  if (dictionary != NULL)
+    inflateSetDictionary(&stream, reinterpret_cast<const Bytef *>(dictionary), dictionary_length);
+  stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(blob + sizeof(header)));
+  stream.avail_in = length - sizeof(header);
+  stream.next_out = reinterpret_cast<Bytef *>(out);
+  stream.avail_out = header.length;
+  int result = inflate(&stream, Z_FINISH);
+  inflateEnd(&stream);
+  return result == Z_STREAM_END && stream.total_out == header.length;
+}
+
+bool Compressor::decompress(const char *blob, size_t length, string &out) const {
+  CompressedHeader header;
+  memcpy(&header, blob, sizeof(header));
+  const shared_string *dict = dictionary(header.dictionary);
+  out.resize(header.length);
+  return Inflate(blob, length, dict == NULL ? NULL : dict->data(), dict == NULL ? 0 : dict->size(), &out[0]);
+}
+
+// Build a dictionary out of the pieces of the samples whose substrings
+// turn up in the most other samples. Pieces are picked greedily, each
+// scored only on what the pieces already picked don't cover. zlib
+// prefers the most useful material closest to the data, so the best
+// pieces go at the end.
+string Compressor::Train(const vector<string> &samples) {
+  boost::unordered_map<uint64_t, uint32_t> frequency;
+  for (auto &sample : samples) {
+    boost::unordered_set<uint64_t> seen;
+    for (size_t i = 0; i + TRAINING_SHINGLE <= sample.size(); i++) {
+      uint64_t hash = FlatTable::hash(sample.data() + i, TRAINING_SHINGLE);
+      if (seen.insert(hash).second)
+        frequency[hash]++;
+    }
+  }
+
+  boost::unordered_set<uint64_t> covered;
+  auto score = [&](const string &sample, size_t start) {
+    uint64_t total = 0;
+    for (size_t i = start; i + TRAINING_SHINGLE <= start + TRAINING_PIECE && i + TRAINING_SHINGLE <= sample.size(); i++) {
+      uint64_t hash = FlatTable::hash(sample.data() + i, TRAINING_SHINGLE);
+      if (covered.find(hash) == covered.end())
+        total += frequency[hash] - 1; // Occurring in only one sample doesn't help
+    }
+    return total;
+  };
+
+  typedef pair<uint64_t, pair<size_t, size_t>> Candidate; // Score, sample, offset
+  priority_queue<Candidate> candidates;
+  for (size_t s = 0; s < samples.size(); s++) {
+    for (size_t start = 0; start + TRAINING_SHINGLE <= samples[s].size(); start += TRAINING_PIECE / 2) {
+      uint64_t initial = score(samples[s], start);
+      if (initial > 0)
+        candidates.push(make_pair(initial, make_pair(s, start)));
+    }
+  }
+
+  vector<string> pieces;
+  size_t size = 0;
+  while (!candidates.empty() && size < MAX_DICTIONARY_SIZE) {
+    Candidate best = candidates.top();
+    candidates.pop();
+    const string &sample = samples[best.second.first];
+    size_t start = best.second.second;
+    uint64_t current_score = score(sample, start);
+    if (current_score == 0)
+      continue;
+    if (!candidates.empty() && current_score < candidates.top().first) {
+      candidates.push(make_pair(current_score, best.second)); // Stale; try again later
+      continue;
+    }
+    string piece = sample.substr(start, min((size_t)TRAINING_PIECE, MAX_DICTIONARY_SIZE - size));
+    for (size_t i = 0; i + TRAINING_SHINGLE <= piece.size(); i++)
+      covered.insert(FlatTable::hash(piece.data() + i, TRAINING_SHINGLE));
+    size += piece.size();
+    pieces.push_back(piece);
+  }
+
+  string dictionary;
+  dictionary.reserve(size);
+  for (auto it = pieces.rbegin(); it != pieces.rend(); ++it)
+    dictionary += *it;
+  return dictionary;
+}
+
+v8::Local<v8::Value> Compressor::GetValue(const char *blob, size_t length) const {
+  CompressedHeader header;
+  memcpy(&header, blob, sizeof(header));
+  const shared_string *dict = dictionary(header.dictionary);
+  char *out = static_cast<char *>(malloc(header.length));
+  if (out == NULL || !Inflate(blob, length, dict == NULL ? NULL : dict->data(), dict == NULL ? 0 : dict->size(), out)) {
+    free(out);
+    Nan::ThrowError("Corrupt compressed value.");
+    return v8::Local<v8::Value>();
+  }
+  if (header.type == BUFFER_TYPE) // The buffer takes ownership of out
+    return Nan::NewBuffer(out, header.length).ToLocalChecked();
+  v8::Local<v8::Value> v = Nan::New<v8::String>(out, header.length).ToLocalChecked();
+  free(out);
+  return v;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <boost/interprocess/containers/vector.hpp>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "cell.hpp"
+
+#define DEFAULT_COMPRESS_THRESHOLD 512 // Bytes
+#define MAX_DICTIONARY_SIZE 32768      // The most a deflate window can see
+#define MAX_TRAINING_SIZE (1ul<<20)    // Sample this much data to train a dictionary
+
+// At the front of every compressed value. Deflate data follows.
+struct CompressedHeader {
+  uint64_t length;     // Uncompressed length
+  uint32_t dictionary; // 1-based index into the Compressor's dictionaries, or 0 for none
+  char type;           // STRING_TYPE or BUFFER_TYPE
+  char reserved[3];
+};
+
+typedef bip::vector<shared_string, SharedAllocator<shared_string>> DictionaryList;
+
+// Compression settings for a file and the dictionaries its values were
+// compressed with. Values are compressed with the newest dictionary;
+// older ones are kept for the values that still use them.
+class Compressor {
+private:
+  uint64_t threshold;
+  DictionaryList dictionaries;
+public:
+  Compressor(size_t threshold, segment_manager_t *segment_manager) :
+    threshold(threshold), dictionaries(segment_manager) {}
+
+  size_t min_length() const { return threshold; }
+  uint32_t current() const { return dictionaries.size(); }
+  const shared_string *dictionary(uint32_t id) const { return id == 0 ? NULL : &dictionaries[id - 1]; }
+  void add_dictionary(const string &dictionary);
+
+  // Fill out with the compressed form of data. Returns false, leaving
+  // out alone, for data too short or too random to be worth it.
+  bool compress(char type, const char *data, size_t length, string &out) const;
+  bool decompress(const char *blob, size_t length, string &out) const;
+  static bool Inflate(const char *blob, size_t length, const char *dictionary, size_t dictionary_length, char *out);
+  static string Train(const vector<string> &samples);
+
+  v8::Local<v8::Value> GetValue(const char *blob, size_t length) const;
+};
@@ -0,0 +1,307 @@
+#include "flat_table.hpp"
+#include "intern.hpp"
+#include "compress.hpp"
+#include "common.hpp"
+
+// Avoid freeing shared memory
+static void NullFreer(char *, void *) {}
+
+static inline int8_t h2(uint64_t hash) { return (int8_t)(hash & 0x7F); }
+
+// Capacity is any whole number of groups, so a table sized for the
+// count it will hold is no more than 1/7 empty.
+FlatTable::FlatTable(size_t expected_count, segment_manager_t *segment_manager) :
+  capacity(0), count(0), deleted(0), ctrl_offset(0), slots_offset(0) {
+  uint64_t new_capacity = (expected_count + expected_count / 7 + FLAT_GROUP_SIZE - 1) / FLAT_GROUP_SIZE *
+    FLAT_GROUP_SIZE;
+  if (new_capacity == 0)
+    new_capacity = FLAT_GROUP_SIZE;
+  while (new_capacity - new_capacity / 8 < expected_count)
+    new_capacity += FLAT_GROUP_SIZE;
+  rehash(new_capacity, segment_manager);
+}
+
+// The hash is stored in the file, so it must never change for a given
+// file format version. FNV-1a is simple and stable; the MurmurHash3
+// finalizer mixes it well enough that both the control byte bits (the
+// low seven) and the group bits (the high 32) are usable.
+uint64_t FlatTable::hash(const char *key, size_t length) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// The group a hash starts probing at. The high bits of the hash are
+// scaled to the number of groups, which needn't be a power of two.
+static inline uint64_t first_group(uint64_t hash, uint64_t groups) {
+  return ((hash >> 32) * groups) >> 32;
+}
+
+// Groups are probed one after the other, wrapping around at the end,
+// which visits every group once whatever their number.
+size_t FlatTable::find_index(const char *key, size_t length, uint64_t hash) const {
+  const uint64_t groups = capacity / FLAT_GROUP_SIZE;
+  uint64_t group = first_group(hash, groups);
+  for (uint64_t step = 0; step < groups; step++) {
+    const size_t first = group * FLAT_GROUP_SIZE;
+    FlatGroup g(ctrl() + first);
+    for (uint32_t mask = g.match(h2(hash)); mask != 0; mask &= mask - 1) {
+      const size_t index = first + FlatGroup::lowest(mask);
+      const FlatSlot &s = slots()[index];
+      if (s.hash == hash && key_length(s) == length &&
+          memcmp(key_data(s), key, length) == 0)
+        return index;
+    }
+    // A probe never continues past a group with an empty slot.
+    if (g.match_empty() != 0)
+      break;
+    group = group + 1 == groups ? 0 : group + 1;
+  }
+  return capacity;
+}
+
+size_t FlatTable::insert_index(const int8_t *ctrl, uint64_t capacity, uint64_t hash) {
+  const uint64_t groups = capacity / FLAT_GROUP_SIZE;
+  uint64_t group = first_group(hash, groups);
+  while (true) {
+    const size_t first = group * FLAT_GROUP_SIZE;
+    uint32_t mask = FlatGroup(ctrl + first).match_empty_or_deleted();
+    if (mask != 0)
+      return first + FlatGroup::lowest(mask);
+    group = group + 1 == groups ? 0 : group + 1;
+  }
+}
+
+// Put data into a payload, inline if it fits. Returns the tag for it.
+uint8_t FlatTable::store(FlatPayload &payload, const char *data, size_t length,
+                         segment_manager_t *segment_manager) {
+  if (length <= FLAT_INLINE_SIZE) {
+    memcpy(payload.bytes, data, length);
+    return (uint8_t)length;
+  }
+  char *external = static_cast<char *>(segment_manager->allocate(length));
+  memcpy(external, data, length);
+  payload.external.offset = external - base();
+  payload.external.length = length;
+  return FLAT_EXTERNAL;
+}
+
+uint8_t FlatTable::store_value(FlatPayload &payload, char type, const char *data, size_t length,
+                               segment_manager_t *segment_manager, InternTable *interned) {
+  if (interned == NULL || length < DEDUP_MIN_LENGTH || type == NUMBER_TYPE)
+    return store(payload, data, length, segment_manager);
+  SharedValue *shared = interned->intern(type, data, length);
+  payload.external.offset = reinterpret_cast<char *>(shared) - base();
+  payload.external.length = length;
+  return FLAT_SHARED;
+}
+
+void FlatTable::release(FlatPayload &payload, uint8_t tag, segment_manager_t *segment_manager,
+                        InternTable *interned) {
+  if (tag == FLAT_EXTERNAL)
+    segment_manager->deallocate(base() + payload.external.offset);
+  else if (tag == FLAT_SHARED)
+    interned->release(reinterpret_cast<SharedValue *>(base() + payload.external.offset));
+}
+
+// Move every entry into freshly allocated arrays. Nothing is changed
+// until both arrays are allocated, so running out of room leaves the
+// table intact for the caller to grow the file and try again.
+void FlatTable::rehash(uint64_t new_capacity, segment_manager_t *segment_manager) {
+  int8_t *new_ctrl = static_cast<int8_t *>(segment_manager->allocate(new_capacity));
+  FlatSlot *new_slots;
+  try {
+    new_slots = static_cast<FlatSlot *>(segment_manager->allocate_aligned(new_capacity * sizeof(FlatSlot),
+                                                                           sizeof(FlatSlot)));
+  } catch(bip::bad_alloc &) {
+    segment_manager->deallocate(new_ctrl);
+    throw;
+  }
+  memset(new_ctrl, CTRL_EMPTY, new_capacity);
+  if (capacity != 0) {
+    for (size_t i = next(0); i < capacity; i = next(i + 1)) {
+      const FlatSlot &s = slots()[i];
+      size_t index = insert_index(new_ctrl, new_capacity, s.hash);
+      new_ctrl[index] = h2(s.hash);
+      new_slots[index] = s;
+    }
+    segment_manager->deallocate(ctrl());
+    segment_manager->deallocate(slots());
+  }
+  capacity = new_capacity;
+  deleted = 0;
+  ctrl_offset = reinterpret_cast<char *>(new_ctrl) - base();
+  slots_offset = reinterpret_cast<char *>(new_slots) - base();
+}
+
+FlatSlot *FlatTable::find(const char *key, size_t key_length) {
+  size_t index = find_index(key, key_length, hash(key, key_length));
+  return index == capacity ? NULL : &slots()[index];
+}
+
+void FlatTable::set(const char *key, size_t key_length, char value_type, const char *value, size_t value_length,
+                    segment_manager_t *segment_manager, InternTable *interned) {
+  uint64_t h = hash(key, key_length);
+  size_t index = find_index(key, key_length, h);
+  if (index != capacity) {
+    replace(slots()[index], value_type, value, value_length, segment_manager, interned);
+    return;
+  }
+
+  if (count + deleted >= capacity - capacity / 8) {
+    // Double when mostly full of live entries, otherwise just sweep
+    // out the tombstones.
+    rehash(count >= capacity / 2 ? capacity * 2 : capacity, segment_manager);
+  }
+
+  FlatSlot s;
+  memset(&s, 0, sizeof(s));
+  s.hash = h;
+  s.value_type = value_type;
+  s.key_tag = store(s.key, key, key_length, segment_manager);
+  try {
+    s.value_tag = store_value(s.value, value_type, value, value_length, segment_manager, interned);
+  } catch(bip::bad_alloc &) {
+    release(s.key, s.key_tag, segment_manager, interned);
+    throw;
+  }
+
+  index = insert_index(ctrl(), capacity, h);
+  if (ctrl()[index] == CTRL_DELETED)
+    deleted--;
+  ctrl()[index] = h2(h);
+  slots()[index] = s;
+  count++;
+}
+
+bool FlatTable::erase(const char *key, size_t key_length, segment_manager_t *segment_manager,
+                      InternTable *interned) {
+  size_t index = find_index(key, key_length, hash(key, key_length));
+  if (index == capacity)
+    return false;
+  FlatSlot &s = slots()[index];
+  release(s.key, s.key_tag, segment_manager, interned);
+  release(s.value, s.value_tag, segment_manager, interned);
+  // If this group still has an empty slot then no probe ever went
+  // past it, so the slot can go straight back to empty.
+  const size_t first = index - index % FLAT_GROUP_SIZE;
+  if (FlatGroup(ctrl() + first).match_empty() != 0) {
+    ctrl()[index] = CTRL_EMPTY;
+  } else {
+    ctrl()[index] = CTRL_DELETED;
+    deleted++;
+  }
+  count--;
+  return true;
+}
+
+// Give an existing slot a new value. The new value is stored before
+// the old one is let go, so it may be a copy of the old one.
+void FlatTable::replace(FlatSlot &slot, char value_type, const char *value, size_t value_length,
+                        segment_manager_t *segment_manager, InternTable *interned) {
+  FlatPayload payload;
+  uint8_t tag = store_value(payload, value_type, value, value_length, segment_manager, interned);
+  release(slot.value, slot.value_tag, segment_manager, interned);
+  slot.value_type = value_type;
+  slot.value_tag = tag;
+  slot.value = payload;
+}
+
+// Swap a value stored out of line for a reference to a shared copy of
+// it. Return whether the slot changed.
+bool FlatTable::share(FlatSlot &slot, segment_manager_t *segment_manager, InternTable *interned) {
+  if (slot.value_tag != FLAT_EXTERNAL)
+    return false;
+  replace(slot, slot.value_type, value_data(slot), value_length(slot), segment_manager, interned);
+  return true;
+}
+
+size_t FlatTable::next(size_t index) const {
+  while (index < capacity && ctrl()[index] < 0)
+    index++;
+  return index;
+}
+
+// As with cells, shared buffers are copied for writable objects.
+v8::Local<v8::Value> FlatTable::GetValue(const FlatSlot &slot, const Compressor *compressor, bool writable) {
+  v8::Local<v8::Value> v;
+  switch (slot.value_type) {
+  case STRING_TYPE:
+    v = Nan::New<v8::String>(value_data(slot), value_length(slot)).ToLocalChecked();
+    break;
+  case BUFFER_TYPE:
+    if (writable && slot.value_tag == FLAT_SHARED)
+      v = Nan::CopyBuffer(value_data(slot), value_length(slot)).ToLocalChecked();
+    else
+      v = Nan::NewBuffer(const_cast<char*>(value_data(slot)), value_length(slot), NullFreer, NULL).ToLocalChecked();
+    break;
+  case NUMBER_TYPE: {
+    double number;
+    memcpy(&number, value_data(slot), sizeof(number));
+    v = Nan::New<v8::Number>(number);
+    break;
+  }
+  case COMPRESSED_TYPE:
+    if (compressor == NULL) {
+      Nan::ThrowError("Compressed value in a file without compression settings.");
+      break;
+    }
+    v = compressor->GetValue(value_data(slot), value_length(slot));
+    break;
+  default:
+    ostringstream error_stream;
+    error_stream << "Unknown cell data type " << dec << (int) slot.value_type;
+    Nan::ThrowError(error_stream.str().c_str());
+  }
+  return v;
+}
+
+// Store the given value under key, compressed if compressor is given
+// and the value is long enough. Return the length of the data stored
+// for the caller's accounting.
+size_t FlatTable::SetValue(const char *key, size_t key_length, v8::Local<v8::Value> value,
+                           bip::managed_mapped_file *segment, InternTable *interned, const Compressor *compressor,
+                           const Nan::PropertyCallbackInfo<v8::Value>& info) {
+  char type;
+  const char *data;
+  size_t length;
+  double number;
+  string str;
+  if (value->IsString()) {
+    v8::String::Utf8Value string_data UTF8VALUE(value);
+    str.assign(*string_data, string_data.length());
+    type = STRING_TYPE;
+    data = str.data();
+    length = str.size();
+  } else if (value->IsNumber()) {
+    type = NUMBER_TYPE;
+    number = Nan::To<double>(value).FromJust();
+    data = reinterpret_cast<const char *>(&number);
+    length = sizeof(number);
+  } else if (value->IsArrayBufferView()) {
+    v8::Local<v8::Object> buf = Nan::To<v8::Object>(value).ToLocalChecked();
+    type = BUFFER_TYPE;
+    data = node::Buffer::Data(buf);
+    length = node::Buffer::Length(buf);
+  } else {
+    Nan::ThrowError("Value must be a string, buffer, or number.");
+    return -1;
+  }
+
+  string compressed;
+  if (compressor != NULL && type != NUMBER_TYPE && compressor->compress(type, data, length, compressed)) {
+    set(key, key_length, COMPRESSED_TYPE, compressed.data(), compressed.size(), segment->get_segment_manager(),
+        interned);
+  } else {
+    set(key, key_length, type, data, length, segment->get_segment_manager(), interned);
+  }
+  return length;
+}
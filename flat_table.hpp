@@ -0,0 +1,170 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include "cell.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #define FLAT_TABLE_SSE2
+  #include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+
+#define FLAT_INLINE_SIZE 24 // Keys and values up to this many bytes live in the slot itself.
+#define FLAT_GROUP_SIZE 16  // Control bytes probed at once.
+#define FLAT_EXTERNAL 0xFF  // Length tag for a key or value stored out of line.
+#define FLAT_SHARED 0xFE    // Length tag for a value held in a SharedValue.
+
+// Control bytes. Full slots hold the low seven bits of the key's hash.
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+// Either the bytes themselves or the location of the bytes (or of
+// their SharedValue) in the segment, relative to the owning FlatTable.
+union FlatPayload {
+  char bytes[FLAT_INLINE_SIZE];
+  struct {
+    int64_t offset;
+    uint64_t length;
+  } external;
+};
+
+// One slot is exactly one cache line. A lookup of a short key with a
+// short value touches the control group and the slot and nothing else.
+struct FlatSlot {
+  uint64_t hash;
+  uint8_t key_tag;    // Inline key length or FLAT_EXTERNAL
+  uint8_t value_type; // STRING_TYPE, NUMBER_TYPE, BUFFER_TYPE, COMPRESSED_TYPE or TOMBSTONE_TYPE
+  uint8_t value_tag;  // Inline value length, FLAT_EXTERNAL or FLAT_SHARED
+  uint8_t reserved[5];
+  FlatPayload key;
+  FlatPayload value;
+};
+
+static_assert(sizeof(FlatSlot) == 64, "FlatSlot must fill exactly one cache line");
+
+// Sixteen control bytes, matched against a hash fragment in one go.
+class FlatGroup {
+private:
+#ifdef FLAT_TABLE_SSE2
+  __m128i ctrl;
+#else
+  const int8_t *ctrl;
+#endif
+public:
+#ifdef FLAT_TABLE_SSE2
+  explicit FlatGroup(const int8_t *pos) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pos))) {}
+  uint32_t match(int8_t h2) const {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl));
+  }
+  // Empty and deleted are the only control bytes with the sign bit set.
+  uint32_t match_empty_or_deleted() const { return _mm_movemask_epi8(ctrl); }
+#else
+  explicit FlatGroup(const int8_t *pos) : ctrl(pos) {}
+  uint32_t match(int8_t h2) const {
+    uint32_t mask = 0;
+    for (int i = 0; i < FLAT_GROUP_SIZE; i++)
+      if (ctrl[i] == h2)
+        mask |= 1u << i;
+    return mask;
+  }
+  uint32_t match_empty_or_deleted() const {
+    uint32_t mask = 0;
+    for (int i = 0; i < FLAT_GROUP_SIZE; i++)
+      if (ctrl[i] < 0)
+        mask |= 1u << i;
+    return mask;
+  }
+#endif
+  uint32_t match_empty() const { return match(CTRL_EMPTY); }
+
+  static int lowest(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+  }
+};
+
+// An open-addressed hash table living entirely inside the mapped
+// segment. Control bytes and slots are separate arrays; keys and values
+// that don't fit in a slot go to the segment's allocator. All locations
+// are stored as offsets from the table itself so nothing in it depends
+// on where the file happens to be mapped.
+class FlatTable {
+private:
+  uint64_t capacity;
+  uint64_t count;
+  uint64_t deleted;
+  int64_t ctrl_offset;
+  int64_t slots_offset;
+
+  char *base() { return reinterpret_cast<char *>(this); }
+  const char *base() const { return reinterpret_cast<const char *>(this); }
+  int8_t *ctrl() { return reinterpret_cast<int8_t *>(base() + ctrl_offset); }
+  const int8_t *ctrl() const { return reinterpret_cast<const int8_t *>(base() + ctrl_offset); }
+  FlatSlot *slots() { return reinterpret_cast<FlatSlot *>(base() + slots_offset); }
+  const FlatSlot *slots() const { return reinterpret_cast<const FlatSlot *>(base() + slots_offset); }
+
+  size_t find_index(const char *key, size_t key_length, uint64_t hash) const;
+  static size_t insert_index(const int8_t *ctrl, uint64_t capacity, uint64_t hash);
+  uint8_t store(FlatPayload &payload, const char *data, size_t length, segment_manager_t *segment_manager);
+  uint8_t store_value(FlatPayload &payload, char type, const char *data, size_t length,
+                      segment_manager_t *segment_manager, InternTable *interned);
+  void release(FlatPayload &payload, uint8_t tag, segment_manager_t *segment_manager, InternTable *interned);
+  void rehash(uint64_t new_capacity, segment_manager_t *segment_manager);
+public:
+  FlatTable(size_t expected_count, segment_manager_t *segment_manager);
+
+  static uint64_t hash(const char *key, size_t length);
+
+  FlatSlot *find(const char *key, size_t key_length);
+  // Long values are shared through interned when it's not NULL. It
+  // must not be NULL if the table holds any shared values.
+  void set(const char *key, size_t key_length, char value_type, const char *value, size_t value_length,
+           segment_manager_t *segment_manager, InternTable *interned);
+  bool erase(const char *key, size_t key_length, segment_manager_t *segment_manager, InternTable *interned);
+  void replace(FlatSlot &slot, char value_type, const char *value, size_t value_length,
+               segment_manager_t *segment_manager, InternTable *interned);
+  bool share(FlatSlot &slot, segment_manager_t *segment_manager, InternTable *interned);
+
+  // Index of the first full slot at or after index, or capacity if none.
+  size_t next(size_t index) const;
+  FlatSlot &slot(size_t index) { return slots()[index]; }
+
+  const char *key_data(const FlatSlot &slot) const {
+    return slot.key_tag == FLAT_EXTERNAL ? base() + slot.key.external.offset : slot.key.bytes;
+  }
+  size_t key_length(const FlatSlot &slot) const {
+    return slot.key_tag == FLAT_EXTERNAL ? slot.key.external.length : slot.key_tag;
+  }
+  const char *value_data(const FlatSlot &slot) const {
+    switch (slot.value_tag) {
+    case FLAT_EXTERNAL:
+      return base() + slot.value.external.offset;
+    case FLAT_SHARED:
+      return reinterpret_cast<const SharedValue *>(base() + slot.value.external.offset)->data();
+    default:
+      return slot.value.bytes;
+    }
+  }
+  size_t value_length(const FlatSlot &slot) const {
+    return slot.value_tag == FLAT_EXTERNAL || slot.value_tag == FLAT_SHARED ?
+      slot.value.external.length : slot.value_tag;
+  }
+
+  size_t size() const { return count; }
+  size_t bucket_count() const { return capacity; }
+  size_t max_bucket_count() const { return (size_t)1 << 31; }
+  float load_factor() const { return (float)count / capacity; }
+  float max_load_factor() const { return 0.875; }
+
+  v8::Local<v8::Value> GetValue(const FlatSlot &slot, const Compressor *compressor, bool writable);
+  size_t SetValue(const char *key, size_t key_length, v8::Local<v8::Value> value, bip::managed_mapped_file *segment,
+                  InternTable *interned, const Compressor *compressor,
+                  const Nan::PropertyCallbackInfo<v8::Value>& info);
+};
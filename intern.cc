@@ -0,0 +1,42 @@
+#include "intern.hpp"
+#include "common.hpp"
+
+SharedValue *InternTable::intern(char type, const char *data, size_t length) {
+  uint64_t hash = FlatTable::hash(data, length);
+  auto range = index.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    SharedValue *value = it->second.get();
+    if (value->type == type && value->length == length && memcmp(value->data(), data, length) == 0) {
+      retain(value);
+      return value;
+    }
+  }
+
+  segment_manager_t *segment_manager = index.get_allocator().get_segment_manager();
+  SharedValue *value = static_cast<SharedValue *>(segment_manager->allocate(sizeof(SharedValue) + length));
+  value->refcount = 1;
+  value->hash = hash;
+  value->length = length;
+  value->type = type;
+  memcpy(value->data(), data, length);
+  try {
+    index.insert(make_pair(hash, bip::offset_ptr<SharedValue>(value)));
+  } catch(bip::bad_alloc &) {
+    segment_manager->deallocate(value);
+    throw;
+  }
+  return value;
+}
+
+void InternTable::release(SharedValue *value) {
+  if (--value->refcount > 0)
+    return;
+  auto range = index.equal_range(value->hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.get() == value) {
+      index.erase(it);
+      break;
+    }
+  }
+  index.get_allocator().get_segment_manager()->deallocate(value);
+}
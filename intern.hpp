@@ -0,0 +1,38 @@
+#pragma once
+#include <boost/unordered_map.hpp>
+#include "cell.hpp"
+#include "flat_table.hpp"
+
+// Values shorter than this already live inside their cell or slot, so
+// there is nothing to gain from sharing them.
+#define DEDUP_MIN_LENGTH (FLAT_INLINE_SIZE + 1)
+
+// Hashes handed to the index are already well mixed.
+struct identity_hash {
+  size_t operator()(uint64_t hash) const { return (size_t)hash; }
+};
+
+typedef boost::unordered_multimap<
+  uint64_t,
+  bip::offset_ptr<SharedValue>,
+  identity_hash,
+  equal_to<uint64_t>,
+  SharedAllocator<pair<const uint64_t, bip::offset_ptr<SharedValue>>>> InternIndex;
+
+// Every distinct string or buffer value stored in dedup mode is kept
+// once, in a reference-counted SharedValue. This indexes them by
+// content so that writing a value already in the file just takes
+// another reference to it.
+class InternTable {
+private:
+  InternIndex index;
+public:
+  explicit InternTable(segment_manager_t *segment_manager) :
+    index(64, identity_hash(), equal_to<uint64_t>(), segment_manager) {}
+
+  // Returns a shared copy of the value with a reference held for the caller.
+  SharedValue *intern(char type, const char *data, size_t length);
+  void retain(SharedValue *value) { value->refcount++; }
+  void release(SharedValue *value);
+  size_t size() const { return index.size(); }
+};
@@ -13,6 +13,10 @@
 #include <boost/unordered_map.hpp>
 #include <boost/version.hpp>
 #include "cell.hpp"
+#include "flat_table.hpp"
+#include "intern.hpp"
+#include "compress.hpp"
+#include "record_stream.hpp"
 #include "common.hpp"
 
 #if BOOST_VERSION < 105500
@@ -39,14 +43,23 @@ typedef bip::basic_string<char, char_traits<char>> char_string;
 
 // This changes whenever fields are added/changed in Cell
 #define FILEVERSION 1
-// Also allow version 0 for now. Revisit once FILEVERSION goes to 2.
+// Also allow version 0, from before files recorded a version. It reads
+// the same as version 1.
 #define ALSOOK 0
+// Files holding a FlatTable instead of a PropertyHash.
+#define FLAT_FILEVERSION 2
+// Hash files that may hold shared, compressed or tombstone cells,
+// which version 1 readers don't know. A version 1 file is moved up to
+// this once it might hold any.
+#define CELLS_FILEVERSION 3
 
 #define CHECK_VERSION(obj)                                              \
-  if (obj->version != FILEVERSION && obj->version != ALSOOK) {          \
+  if (obj->version != FILEVERSION && obj->version != ALSOOK &&          \
+      obj->version != FLAT_FILEVERSION && obj->version != CELLS_FILEVERSION) { \
     ostringstream error_stream;                                         \
-    error_stream << "File " << *filename << " is format version " << obj->version; \
-    error_stream << " (version " << FILEVERSION << " is expected)";     \
+    error_stream << "File " << obj->file_name << " is format version " << obj->version; \
+    error_stream << " (version " << FILEVERSION << ", " << FLAT_FILEVERSION << " or " << CELLS_FILEVERSION; \
+    error_stream << " is expected)";                                    \
     Nan::ThrowError(error_stream.str().c_str());                        \
     return;                                                             \
   }
@@ -82,11 +95,51 @@ typedef boost::unordered_map<
   s_equal_to,
   map_allocator> PropertyHash;
 
+// A key and its value in one file: a slot in a flat table or a cell in
+// a hash table. Neither is set if the file has no such key.
+struct Entry {
+  const char *key;
+  size_t key_length;
+  FlatTable *table;
+  FlatSlot *slot;
+  Cell *cell;
+  const Compressor *compressor;
+  double number; // Copied out of a number cell, which can't point at it
+
+  Entry() : key(NULL), key_length(0), table(NULL), slot(NULL), cell(NULL), compressor(NULL), number(0) {}
+  Entry(FlatTable *table, FlatSlot *slot, const Compressor *compressor) :
+    key(table->key_data(*slot)), key_length(table->key_length(*slot)), table(table), slot(slot), cell(NULL),
+    compressor(compressor), number(0) {}
+  Entry(const shared_string &key, Cell *cell, const Compressor *compressor) :
+    key(key.c_str()), key_length(key.size()), table(NULL), slot(NULL), cell(cell), compressor(compressor),
+    number(cell->value_type() == NUMBER_TYPE ? (double)*cell : 0) {}
+
+  bool found() const { return slot != NULL || cell != NULL; }
+  char type() { return slot != NULL ? slot->value_type : cell->value_type(); }
+  const char *data() {
+    if (slot != NULL)
+      return table->value_data(*slot);
+    return type() == NUMBER_TYPE ? reinterpret_cast<const char *>(&number) : cell->c_str();
+  }
+  size_t length() {
+    if (slot != NULL)
+      return table->value_length(*slot);
+    return type() == NUMBER_TYPE ? sizeof(number) : cell->length();
+  }
+  v8::Local<v8::Value> GetValue(bool writable) {
+    return slot != NULL ? table->GetValue(*slot, compressor, writable) : cell->GetValue(compressor, writable);
+  }
+};
+
 class SharedMap : public Nan::ObjectWrap {
   SharedMap(const string &file_name, size_t file_size, size_t max_file_size) :
-    file_name(file_name), file_size(file_size), max_file_size(max_file_size),
-    readonly(false), closed(true) {}
-  explicit SharedMap(const string &file_name) : file_name(file_name), readonly(false), closed(true) {}
+    file_name(file_name), file_size(file_size), max_file_size(max_file_size), map_seg(NULL),
+    flat_map(NULL), interned(NULL), compressor(NULL), overlay(NULL), readonly(false), closed(true), merging(false),
+    exporting(0) {}
+  explicit SharedMap(const string &file_name) :
+    file_name(file_name), map_seg(NULL), flat_map(NULL), interned(NULL), compressor(NULL), overlay(NULL),
+    readonly(false), closed(true), merging(false), exporting(0) {}
+  ~SharedMap() { delete overlay; }
 
 public:
   static NAN_MODULE_INIT(Init);
@@ -98,11 +151,31 @@ private:
   bip::managed_mapped_file *map_seg;
   uint32_t version;
   PropertyHash *property_map;
+  FlatTable *flat_map; // Set instead of property_map for FLAT_FILEVERSION files
+  InternTable *interned; // Set when writing in dedup mode
+  Compressor *compressor; // Set when the file has compression settings
+  SharedMap *overlay; // Set when writes go to a delta file layered over this one
   bool readonly;
   bool closed;
+  bool merging;
+  unsigned exporting; // Exports under way, which hold off writes
   PropertyHash::iterator iter;
+  size_t flat_iter;
 
   void grow(size_t);
+  void map_file(uint32_t new_version, bool create = false);
+  void find_tables(size_t initial_bucket_count, bool dedup, size_t compress_threshold);
+  void mark_cells();
+  void unmap();
+  size_t size() const { return flat_map != NULL ? flat_map->size() : property_map->size(); }
+  size_t buckets() const { return flat_map != NULL ? flat_map->bucket_count() : property_map->bucket_count(); }
+  Entry find(const char *key, size_t length);
+  Entry lookup(const char *key, size_t length);
+  Entry next_entry();
+  void rewind();
+  template <typename F> void each(F visit);
+  void insert(const char *key, size_t key_length, char type, const char *data, size_t length);
+  size_t export_records(size_t bucket, SharedMap *mask, string &out);
   static NAN_METHOD(Create);
   static NAN_METHOD(Open);
   static NAN_METHOD(Close);
@@ -116,6 +189,13 @@ private:
   static NAN_METHOD(load_factor);
   static NAN_METHOD(max_load_factor);
   static NAN_METHOD(fileFormatVersion);
+  static NAN_METHOD(dedup);
+  static NAN_METHOD(compress);
+  static NAN_METHOD(compressed_count);
+  static NAN_METHOD(getAsync);
+  static NAN_METHOD(merge);
+  static NAN_METHOD(exportStream);
+  static NAN_METHOD(importStream);
   static NAN_METHOD(next);
   static NAN_PROPERTY_SETTER(PropSetter);
   static NAN_PROPERTY_GETTER(PropGetter);
@@ -134,19 +214,135 @@ private:
     return my_constructor;
   }
   friend struct CloseWorker;
+  friend struct MergeWorker;
+  friend struct Exporter;
+  friend struct Importer;
 };
 
+// This file's own entry for key, which may be a tombstone.
+Entry SharedMap::find(const char *key, size_t length) {
+  if (flat_map != NULL) {
+    FlatSlot *slot = flat_map->find(key, length);
+    return slot == NULL ? Entry() : Entry(flat_map, slot, compressor);
+  }
+  // Flat files' keys aren't NUL-terminated, so the length is what counts.
+  auto pair = property_map->find<char_string, hasher, s_equal_to>(char_string(key, length), hasher(), s_equal_to());
+  return pair == property_map->end() ? Entry() : Entry(pair->first, &pair->second, compressor);
+}
+
+// The entry a reader sees for key: the overlay's if it has one,
+// otherwise this file's. Deleted keys aren't found.
+Entry SharedMap::lookup(const char *key, size_t length) {
+  Entry entry;
+  if (overlay != NULL)
+    entry = overlay->find(key, length);
+  if (!entry.found())
+    entry = find(key, length);
+  if (entry.found() && entry.type() == TOMBSTONE_TYPE)
+    return Entry();
+  return entry;
+}
+
+// The next entry in this file's own table for the iteration protocol.
+Entry SharedMap::next_entry() {
+  if (flat_map != NULL) {
+    flat_iter = flat_map->next(flat_iter);
+    if (flat_iter == flat_map->bucket_count())
+      return Entry();
+    return Entry(flat_map, &flat_map->slot(flat_iter++), compressor);
+  }
+  if (iter == property_map->end())
+    return Entry();
+  Entry entry(iter->first, &iter->second, compressor);
+  iter++;
+  return entry;
+}
+
+void SharedMap::rewind() {
+  if (flat_map != NULL)
+    flat_iter = 0;
+  else
+    iter = property_map->begin();
+  if (overlay != NULL)
+    overlay->rewind();
+}
+
+// Call visit on every entry in this file's own table.
+template <typename F> void SharedMap::each(F visit) {
+  if (flat_map != NULL) {
+    for (size_t i = flat_map->next(0); i < flat_map->bucket_count(); i = flat_map->next(i + 1)) {
+      Entry entry(flat_map, &flat_map->slot(i), compressor);
+      visit(entry);
+    }
+    return;
+  }
+  for (auto it = property_map->begin(); it != property_map->end(); ++it) {
+    Entry entry(it->first, &it->second, compressor);
+    visit(entry);
+  }
+}
+
+// Store raw data of the given type under key, growing the file as
+// needed. Strings and buffers are compressed if the file is set up for
+// it. This doesn't touch v8, so a merge can run it off the main thread.
+void SharedMap::insert(const char *key, size_t key_length, char type, const char *data, size_t length) {
+  string compressed;
+  if (compressor != NULL && (type == STRING_TYPE || type == BUFFER_TYPE) &&
+      compressor->compress(type, data, length, compressed)) {
+    type = COMPRESSED_TYPE;
+    data = compressed.data();
+    length = compressed.size();
+  }
+  while (true) {
+    try {
+      if (flat_map != NULL) {
+        flat_map->set(key, key_length, type, data, length, map_seg->get_segment_manager(), interned);
+        return;
+      }
+      if (type == TOMBSTONE_TYPE)
+        mark_cells();
+      unique_ptr<Cell> c;
+      if (type == NUMBER_TYPE) {
+        double number;
+        memcpy(&number, data, sizeof(number));
+        c.reset(new Cell(number));
+      } else {
+        c.reset(Cell::Make(type, data, length, map_seg, interned, NULL));
+      }
+      char_allocator allocer(map_seg->get_segment_manager());
+      shared_string string_key(key, key_length, allocer);
+      auto pair = property_map->insert({ string_key, *c });
+      if (!pair.second) {
+        property_map->erase(string_key);
+        property_map->insert({ string_key, *c });
+      }
+      return;
+    } catch(length_error &) {
+      grow(file_size);
+    } catch(bip::bad_alloc &) {
+      grow(file_size);
+    }
+  }
+}
+
 boost::unordered_map<std::string, bool> methodList = boost::assign::map_list_of
                                                    ("bucket_count", true)
                                                    ("close", true)
+                                                   ("compress", true)
+                                                   ("compressed_count", true)
+                                                   ("dedup", true)
+                                                   ("exportStream", true)
+                                                   ("getAsync", true)
                                                    ("get_free_memory", true)
                                                    ("get_size", true)
+                                                   ("importStream", true)
                                                    ("isClosed", true)
                                                    ("isData", true)
                                                    ("isOpen", true)
                                                    ("load_factor", true)
                                                    ("max_bucket_count", true)
                                                    ("max_load_factor", true)
+                                                   ("merge", true)
                                                    ("propertyIsEnumerable", true)
                                                    ("toString", true)
                                                    ("fileFormatVersion", true)
@@ -168,18 +364,37 @@ NAN_PROPERTY_SETTER(SharedMap::PropSetter) {
     return;
   }
 
+  if (self->exporting != 0) {
+    Nan::ThrowError("Cannot write to an object during an export.");
+    return;
+  }
+
   if (property->IsSymbol()) {
     Nan::ThrowError("Symbol properties are not supported.");
     return;
   }
 
+  // All writes to an object with an overlay go to the overlay.
+  if (self->overlay != NULL)
+    self = self->overlay;
+
+  // Room for the new entry if the file fills up. A flat table
+  // allocates its doubled arrays in one go when it fills, which could
+  // be far more than that, so flat files double instead.
   size_t data_length = sizeof(Cell);
 
   try {
     unique_ptr<Cell> c;
     while(true) {
       try {
-        data_length += Cell::SetValue(value, self->map_seg, c, info);
+        if (self->flat_map != NULL) {
+          v8::String::Utf8Value prop UTF8VALUE(property);
+          data_length += prop.length();
+          data_length += self->flat_map->SetValue(*prop, prop.length(), value, self->map_seg, self->interned,
+                                                  self->compressor, info);
+          break;
+        }
+        data_length += Cell::SetValue(value, self->map_seg, self->interned, self->compressor, c, info);
         v8::String::Utf8Value prop UTF8VALUE(property);
         data_length += prop.length();
         char_allocator allocer(self->map_seg->get_segment_manager());
@@ -191,9 +406,11 @@ NAN_PROPERTY_SETTER(SharedMap::PropSetter) {
         }
         break;
       } catch(length_error) {
-        self->grow(data_length * 2);
+        c.reset(); // Let go of anything in the segment before it moves
+        self->grow(self->flat_map != NULL ? self->file_size : data_length * 2);
       } catch(bip::bad_alloc) {
-        self->grow(data_length * 2);
+        c.reset();
+        self->grow(self->flat_map != NULL ? self->file_size : data_length * 2);
       }
     }
   } catch(FileTooLarge) {
@@ -238,24 +455,34 @@ NAN_METHOD(SharedMap::next) {
 
   auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.Data().As<v8::Object>());
 
+  // Entries in an overlay come first, then those in the base that the
+  // overlay neither replaces nor deletes.
+  Entry entry;
+  while (true) {
+    entry = self->overlay != NULL ? self->overlay->next_entry() : Entry();
+    if (!entry.found()) {
+      entry = self->next_entry();
+      if (entry.found() && self->overlay != NULL && self->overlay->find(entry.key, entry.key_length).found())
+        continue;
+    }
+    if (!entry.found() || entry.type() != TOMBSTONE_TYPE)
+      break;
+  }
+
   // Determine if we're at the end of the iteration
-  if (self->iter == self->property_map->end()) {
+  if (!entry.found()) {
     Nan::Set(obj, Nan::New<v8::String>("done").ToLocalChecked(), Nan::True());
     return;
   }
 
   // Iterate and return an array of [key, value] for this step.
   auto arr = Nan::New<v8::Array>();
-
-  Nan::Set(arr, 0, Nan::New<v8::String>(self->iter->first.c_str()).ToLocalChecked()); // key
-
-  Cell *c = &self->iter->second; // value
-  Nan::Set(arr, 1, c->GetValue());
+  Nan::Set(arr, 0, Nan::New<v8::String>(entry.key, entry.key_length).ToLocalChecked());
+  Nan::Set(arr, 1, entry.GetValue(!self->readonly));
 
   // Per iteration protocol, the value property of the returned object
   // holds the data for this iteration.
   Nan::Set(obj, Nan::New<v8::String>("value").ToLocalChecked(), arr);
-  self->iter++;
 }
 
 NAN_PROPERTY_GETTER(SharedMap::PropGetter) {
@@ -269,7 +496,8 @@ NAN_PROPERTY_GETTER(SharedMap::PropGetter) {
   if (property->IsSymbol()) {
     // Handle iteration
     if (Nan::Equals(property, v8::Symbol::GetIterator(info.GetIsolate())).FromJust()) {
-      self->iter = self->property_map->begin(); // Reset the iterator
+      // Reset the iterator
+      self->rewind();
       auto iter_template = Nan::New<v8::FunctionTemplate>();
       Nan::SetCallHandler(iter_template, [](const Nan::FunctionCallbackInfo<v8::Value> &info) {
           auto next_template = Nan::New<v8::FunctionTemplate>();
@@ -292,15 +520,13 @@ NAN_PROPERTY_GETTER(SharedMap::PropGetter) {
     return;
   }
 
-  auto pair = self->property_map->find<char_string, hasher, s_equal_to>
-    (*src, hasher(), s_equal_to());
+  Entry entry = self->lookup(*src, src.length());
 
   // If the map doesn't have it, let v8 continue the search.
-  if (pair == self->property_map->end())
+  if (!entry.found())
     return;
 
-  Cell *c = &pair->second;
-  info.GetReturnValue().Set(c->GetValue());
+  info.GetReturnValue().Set(entry.GetValue(!self->readonly));
 }
 
 NAN_PROPERTY_QUERY(SharedMap::PropQuery) {
@@ -345,7 +571,29 @@ NAN_PROPERTY_DELETER(SharedMap::PropDeleter) {
     return;
   }
 
+  if (self->exporting != 0) {
+    Nan::ThrowError("Cannot delete from an object during an export.");
+    return;
+  }
+
   v8::String::Utf8Value prop UTF8VALUE(property);
+  if (self->overlay != NULL) {
+    // A key in the base is masked with a tombstone. Any other key only
+    // needs to go from the overlay.
+    if (self->find(*prop, prop.length()).found()) {
+      try {
+        self->overlay->insert(*prop, prop.length(), TOMBSTONE_TYPE, "", 0);
+      } catch(FileTooLarge &) {
+        Nan::ThrowError("File grew too large.");
+      }
+      return;
+    }
+    self = self->overlay;
+  }
+  if (self->flat_map != NULL) {
+    self->flat_map->erase(*prop, prop.length(), self->map_seg->get_segment_manager(), self->interned);
+    return;
+  }
   shared_string *string_key;
   char_allocator allocer(self->map_seg->get_segment_manager());
   string_key = new shared_string(string(*prop).c_str(), allocer);
@@ -362,9 +610,17 @@ NAN_PROPERTY_ENUMERATOR(SharedMap::PropEnumerator) {
   }
 
   int i = 0;
-  for (auto it = self->property_map->begin(); it != self->property_map->end(); ++it) {
-    Nan::Set(arr, i++, Nan::New<v8::String>(it->first.c_str()).ToLocalChecked());
+  SharedMap *overlay = self->overlay;
+  if (overlay != NULL) {
+    overlay->each([&](Entry &entry) {
+      if (entry.type() != TOMBSTONE_TYPE)
+        Nan::Set(arr, i++, Nan::New<v8::String>(entry.key, entry.key_length).ToLocalChecked());
+    });
   }
+  self->each([&](Entry &entry) {
+    if (entry.type() != TOMBSTONE_TYPE && (overlay == NULL || !overlay->find(entry.key, entry.key_length).found()))
+      Nan::Set(arr, i++, Nan::New<v8::String>(entry.key, entry.key_length).ToLocalChecked());
+  });
   info.GetReturnValue().Set(arr);
 }
 
@@ -373,18 +629,823 @@ NAN_PROPERTY_ENUMERATOR(SharedMap::PropEnumerator) {
   info.GetReturnValue().Set((type)self->object->name()); \
 }
 
+// Same, for methods that both kinds of table answer.
+#define TABLE_INFO_METHOD(name, type) NAN_METHOD(SharedMap::name) { \
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This()); \
+  if (self->flat_map != NULL) \
+    info.GetReturnValue().Set((type)self->flat_map->name()); \
+  else \
+    info.GetReturnValue().Set((type)self->property_map->name()); \
+}
+
 INFO_METHOD(get_free_memory, uint32_t, map_seg)
 INFO_METHOD(get_size, uint32_t, map_seg)
-INFO_METHOD(bucket_count, uint32_t, property_map)
-INFO_METHOD(max_bucket_count, uint32_t, property_map)
-INFO_METHOD(load_factor, float, property_map)
-INFO_METHOD(max_load_factor, float, property_map)
+TABLE_INFO_METHOD(bucket_count, uint32_t)
+TABLE_INFO_METHOD(max_bucket_count, uint32_t)
+TABLE_INFO_METHOD(load_factor, float)
+TABLE_INFO_METHOD(max_load_factor, float)
 
 NAN_METHOD(SharedMap::fileFormatVersion) {
   auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
   info.GetReturnValue().Set((uint32_t)self->version);
 }
 
+// Create and Open take an optional object of options as their last
+// argument. An empty object stands in when none was given.
+static v8::Local<v8::Object> GetOptions(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  if (info.Length() > 1) {
+    auto last = info[info.Length() - 1];
+    if (last->IsObject() && !last->IsFunction())
+      return Nan::To<v8::Object>(last).ToLocalChecked();
+  }
+  return Nan::New<v8::Object>();
+}
+
+// Share every long value already in the object, putting the object in
+// dedup mode if it isn't already. Returns the number of bytes by which
+// the data shrank, which is negative if there were too few duplicates
+// to pay for the sharing.
+NAN_METHOD(SharedMap::dedup) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (self->readonly) {
+    Nan::ThrowError("Read-only object.");
+    return;
+  }
+  if (self->closed) {
+    Nan::ThrowError("Cannot write to closed object.");
+    return;
+  }
+  if (self->exporting != 0) {
+    Nan::ThrowError("Cannot write to an object during an export.");
+    return;
+  }
+  if (self->overlay != NULL)
+    self = self->overlay;
+
+  double initial_used = self->map_seg->get_size() - self->map_seg->get_free_memory();
+  try {
+    while (true) {
+      try {
+        auto segment_manager = self->map_seg->get_segment_manager();
+        if (self->interned == NULL)
+          self->interned = self->map_seg->find_or_construct<InternTable>("interned")(segment_manager);
+        self->mark_cells();
+        // Shared values are skipped, so a pass cut short by growing the
+        // file can just start again.
+        if (self->flat_map != NULL) {
+          FlatTable *table = self->flat_map;
+          for (size_t i = table->next(0); i < table->bucket_count(); i = table->next(i + 1))
+            table->share(table->slot(i), segment_manager, self->interned);
+        } else {
+          for (auto it = self->property_map->begin(); it != self->property_map->end(); ++it)
+            it->second.Share(self->interned);
+        }
+        break;
+      } catch(length_error &) {
+        self->grow(self->file_size);
+      } catch(bip::bad_alloc &) {
+        self->grow(self->file_size);
+      }
+    }
+  } catch(FileTooLarge &) {
+    Nan::ThrowError("File grew too large.");
+    return;
+  }
+  double used = self->map_seg->get_size() - self->map_seg->get_free_memory();
+  info.GetReturnValue().Set(initial_used - used);
+}
+
+// The uncompressed form of a value. Returns its type.
+static char Uncompressed(const Compressor *compressor, char type, const char *data, size_t length, string &out) {
+  if (type == COMPRESSED_TYPE) {
+    CompressedHeader header;
+    memcpy(&header, data, sizeof(header));
+    compressor->decompress(data, length, out);
+    return header.type;
+  }
+  out.assign(data, length);
+  return type;
+}
+
+// Train a new dictionary on the long values in the object and
+// recompress them all with it, putting the object in compression mode
+// if it isn't already. Returns the number of bytes by which the data
+// shrank.
+NAN_METHOD(SharedMap::compress) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (self->readonly) {
+    Nan::ThrowError("Read-only object.");
+    return;
+  }
+  if (self->closed) {
+    Nan::ThrowError("Cannot write to closed object.");
+    return;
+  }
+  if (self->exporting != 0) {
+    Nan::ThrowError("Cannot write to an object during an export.");
+    return;
+  }
+  if (self->overlay != NULL)
+    self = self->overlay;
+
+  size_t threshold = self->compressor != NULL ? self->compressor->min_length() : DEFAULT_COMPRESS_THRESHOLD;
+  vector<string> samples;
+  size_t sampled = 0;
+  auto sample = [&](char type, const char *data, size_t length) {
+    string value;
+    if (sampled >= MAX_TRAINING_SIZE || Uncompressed(self->compressor, type, data, length, value) == NUMBER_TYPE ||
+        value.size() < threshold)
+      return;
+    value.resize(min(value.size(), MAX_TRAINING_SIZE / 64));
+    sampled += value.size();
+    samples.push_back(value);
+  };
+  if (self->flat_map != NULL) {
+    FlatTable *table = self->flat_map;
+    for (size_t i = table->next(0); i < table->bucket_count(); i = table->next(i + 1)) {
+      FlatSlot &slot = table->slot(i);
+      sample(slot.value_type, table->value_data(slot), table->value_length(slot));
+    }
+  } else {
+    for (auto it = self->property_map->begin(); it != self->property_map->end(); ++it) {
+      if (it->second.value_type() != NUMBER_TYPE)
+        sample(it->second.value_type(), it->second.c_str(), it->second.length());
+    }
+  }
+  string dictionary = Compressor::Train(samples);
+
+  // Work out what a value should be replaced with, if anything. Values
+  // already compressed with the new dictionary are left alone, so a
+  // pass cut short by growing the file can just start again.
+  auto recompress = [&](char type, const char *data, size_t length, char &new_type, string &new_value) -> bool {
+    if (type == NUMBER_TYPE || (type != COMPRESSED_TYPE && length < threshold))
+      return false;
+    if (type == COMPRESSED_TYPE) {
+      CompressedHeader header;
+      memcpy(&header, data, sizeof(header));
+      if (header.dictionary == self->compressor->current())
+        return false;
+    }
+    string value;
+    char value_type = Uncompressed(self->compressor, type, data, length, value);
+    if (self->compressor->compress(value_type, value.data(), value.size(), new_value)) {
+      new_type = COMPRESSED_TYPE;
+      return true;
+    }
+    new_type = value_type;
+    new_value.swap(value);
+    return type == COMPRESSED_TYPE; // No longer worth compressing
+  };
+
+  double initial_used = self->map_seg->get_size() - self->map_seg->get_free_memory();
+  bool added = false;
+  try {
+    while (true) {
+      try {
+        auto segment_manager = self->map_seg->get_segment_manager();
+        if (self->compressor == NULL)
+          self->compressor = self->map_seg->find_or_construct<Compressor>("compression")(threshold, segment_manager);
+        self->mark_cells();
+        if (!added && !dictionary.empty())
+          self->compressor->add_dictionary(dictionary);
+        added = true;
+        char new_type;
+        string new_value;
+        if (self->flat_map != NULL) {
+          FlatTable *table = self->flat_map;
+          for (size_t i = table->next(0); i < table->bucket_count(); i = table->next(i + 1)) {
+            FlatSlot &slot = table->slot(i);
+            if (recompress(slot.value_type, table->value_data(slot), table->value_length(slot), new_type, new_value))
+              table->replace(slot, new_type, new_value.data(), new_value.size(), segment_manager, self->interned);
+          }
+        } else {
+          for (auto it = self->property_map->begin(); it != self->property_map->end(); ++it) {
+            Cell &cell = it->second;
+            if (cell.value_type() != NUMBER_TYPE &&
+                recompress(cell.value_type(), cell.c_str(), cell.length(), new_type, new_value))
+              cell.Replace(new_type, new_value.data(), new_value.size(), segment_manager, self->interned);
+          }
+        }
+        break;
+      } catch(length_error &) {
+        self->grow(self->file_size);
+      } catch(bip::bad_alloc &) {
+        self->grow(self->file_size);
+      }
+    }
+  } catch(FileTooLarge &) {
+    Nan::ThrowError("File grew too large.");
+    return;
+  }
+  double used = self->map_seg->get_size() - self->map_seg->get_free_memory();
+  info.GetReturnValue().Set(initial_used - used);
+}
+
+// The number of values stored compressed, counting the overlay's too.
+NAN_METHOD(SharedMap::compressed_count) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (self->closed) {
+    Nan::ThrowError("Cannot read from closed object.");
+    return;
+  }
+  double count = 0;
+  auto visit = [&](Entry &entry) {
+    if (entry.type() == COMPRESSED_TYPE)
+      count++;
+  };
+  self->each(visit);
+  if (self->overlay != NULL)
+    self->overlay->each(visit);
+  info.GetReturnValue().Set(count);
+}
+
+// Fetches a value for a callback. A compressed value is copied out of
+// the map along with its dictionary and decompressed on a worker
+// thread, leaving the main thread free for large values.
+struct GetWorker : public Nan::AsyncWorker {
+  string blob; // Empty unless the value is compressed
+  string dictionary;
+  CompressedHeader header;
+  char *data;
+  explicit GetWorker(Nan::Callback *callback) : AsyncWorker(callback), data(NULL) {}
+  ~GetWorker() { free(data); }
+  virtual void Execute() { // May run in a separate thread
+    if (blob.empty())
+      return;
+    memcpy(&header, blob.data(), sizeof(header));
+    data = static_cast<char *>(malloc(header.length));
+    if (data == NULL || !Compressor::Inflate(blob.data(), blob.size(), dictionary.empty() ? NULL : dictionary.data(),
+                                             dictionary.size(), data))
+      SetErrorMessage("Corrupt compressed value.");
+  }
+  virtual void HandleOKCallback() {
+    Nan::HandleScope scope;
+    v8::Local<v8::Value> value;
+    if (blob.empty()) {
+      value = GetFromPersistent("value");
+    } else if (header.type == BUFFER_TYPE) {
+      value = Nan::NewBuffer(data, header.length).ToLocalChecked(); // The buffer takes data
+      data = NULL;
+    } else {
+      value = Nan::New<v8::String>(data, header.length).ToLocalChecked();
+    }
+    v8::Local<v8::Value> argv[] = { Nan::Null(), value };
+    callback->Call(2, argv, async_resource);
+  }
+};
+
+NAN_METHOD(SharedMap::getAsync) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (!info[1]->IsFunction()) {
+    Nan::ThrowError("getAsync needs a callback.");
+    return;
+  }
+  if (self->closed) {
+    Nan::ThrowError("Cannot read from closed object.");
+    return;
+  }
+  Nan::Utf8String key(Nan::To<v8::String>(info[0]).ToLocalChecked());
+  auto worker = new GetWorker(new Nan::Callback(info[1].As<v8::Function>()));
+
+  Entry entry = self->lookup(*key, key.length());
+  v8::Local<v8::Value> value = Nan::Undefined();
+  if (entry.found() && entry.type() == COMPRESSED_TYPE && entry.compressor != NULL) {
+    worker->blob.assign(entry.data(), entry.length());
+    memcpy(&worker->header, entry.data(), sizeof(worker->header));
+    const shared_string *dictionary = entry.compressor->dictionary(worker->header.dictionary);
+    if (dictionary != NULL)
+      worker->dictionary.assign(dictionary->data(), dictionary->size());
+  } else {
+    if (entry.found() && entry.type() != COMPRESSED_TYPE)
+      value = entry.GetValue(!self->readonly);
+    worker->SaveToPersistent("value", value);
+  }
+  AsyncQueueWorker(worker);
+}
+
+// Writes what a reader of an object sees, overlay included, to a new
+// file in the base's format and with its settings. The overlay is
+// copied out on the main thread, so writes to it can carry on during
+// the merge without being picked up. The base is read-only and is read
+// straight from the map on the worker thread.
+struct MergeWorker : public Nan::AsyncWorker {
+  struct Change {
+    char type; // TOMBSTONE_TYPE for a deletion
+    string value; // Uncompressed
+  };
+  SharedMap *map;
+  SharedMap *out;
+  bool dedup;
+  boost::unordered_map<string, Change> changes;
+  MergeWorker(Nan::Callback *callback, v8::Local<v8::Object> object, SharedMap *out)
+    : AsyncWorker(callback), map(Nan::ObjectWrap::Unwrap<SharedMap>(object)), out(out) {
+    SaveToPersistent(uint32_t(0), object);
+    dedup = map->map_seg->find<InternTable>("interned").first != NULL;
+  }
+  ~MergeWorker() { delete out; }
+  virtual void Execute() { // May run in a separate thread
+    bool created = false;
+    try {
+      // Anything at the path by now was put there since merge() checked,
+      // and is neither merged into nor removed.
+      out->map_file(map->version == FLAT_FILEVERSION ? FLAT_FILEVERSION : FILEVERSION, true);
+      created = true;
+      out->find_tables(map->size() + changes.size(), dedup,
+                       map->compressor != NULL ? map->compressor->min_length() : 0);
+      // With the same dictionaries, compressed values can be copied as
+      // they are.
+      while (out->compressor != NULL && out->compressor->current() < map->compressor->current()) {
+        try {
+          const shared_string *dictionary = map->compressor->dictionary(out->compressor->current() + 1);
+          out->compressor->add_dictionary(string(dictionary->data(), dictionary->size()));
+        } catch(bip::bad_alloc &) {
+          out->grow(out->file_size);
+        }
+      }
+      map->each([&](Entry &entry) {
+        if (entry.type() != TOMBSTONE_TYPE && changes.find(string(entry.key, entry.key_length)) == changes.end())
+          out->insert(entry.key, entry.key_length, entry.type(), entry.data(), entry.length());
+      });
+      for (auto &change : changes) {
+        if (change.second.type != TOMBSTONE_TYPE)
+          out->insert(change.first.data(), change.first.size(), change.second.type, change.second.value.data(),
+                      change.second.value.size());
+      }
+      out->unmap();
+    } catch(FileTooLarge &) {
+      SetErrorMessage("File grew too large.");
+    } catch(bip::interprocess_exception &ex) {
+      ostringstream error_stream;
+      error_stream << "Can't create file " << out->file_name << ": " << ex.what();
+      SetErrorMessage(error_stream.str().c_str());
+    }
+    if (ErrorMessage() != NULL && created) { // Leave nothing half-written behind
+      delete out->map_seg;
+      out->map_seg = NULL;
+      remove(out->file_name.c_str());
+    }
+  }
+  virtual void HandleOKCallback() {
+    map->merging = false;
+    AsyncWorker::HandleOKCallback();
+  }
+  virtual void HandleErrorCallback() {
+    map->merging = false;
+    AsyncWorker::HandleErrorCallback();
+  }
+};
+
+NAN_METHOD(SharedMap::merge) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (!info[1]->IsFunction()) {
+    Nan::ThrowError("merge needs a callback.");
+    return;
+  }
+  if (self->closed) {
+    Nan::ThrowError("Cannot read from closed object.");
+    return;
+  }
+  // The worker reads the base while the main thread carries on, which
+  // is only safe when nothing can write to it.
+  if (!self->readonly && self->overlay == NULL) {
+    Nan::ThrowError("Only objects from Open can be merged.");
+    return;
+  }
+  if (self->merging) {
+    Nan::ThrowError("A merge is already running.");
+    return;
+  }
+  Nan::Utf8String filename(Nan::To<v8::String>(info[0]).ToLocalChecked());
+  struct stat buf;
+  if (stat(*filename, &buf) == 0) {
+    ostringstream error_stream;
+    error_stream << "File " << *filename << " already exists.";
+    Nan::ThrowError(error_stream.str().c_str());
+    return;
+  }
+
+  // Start big enough for everything, so that a large base doesn't take
+  // many rounds of growing the new file.
+  size_t file_size = self->map_seg->get_size();
+  if (self->overlay != NULL)
+    file_size += self->overlay->map_seg->get_size();
+  auto out = new SharedMap(*filename, file_size, max(file_size * 4, (size_t)DEFAULT_MAX_SIZE));
+  auto worker = new MergeWorker(new Nan::Callback(info[1].As<v8::Function>()), info.This(), out);
+  if (self->overlay != NULL) {
+    const Compressor *compressor = self->overlay->compressor;
+    self->overlay->each([&](Entry &entry) {
+      MergeWorker::Change &change = worker->changes[string(entry.key, entry.key_length)];
+      change.type = Uncompressed(compressor, entry.type(), entry.data(), entry.length(), change.value);
+    });
+  }
+  self->merging = true;
+  AsyncQueueWorker(worker);
+}
+
+// Append records for this file's entries, starting at the given
+// bucket, until out holds a chunk's worth. Tombstones are skipped, as
+// is anything mask has an entry for. Returns the bucket to carry on
+// from, which is buckets() once there are none left. The bucket only
+// means the same thing on the next call if the table hasn't been
+// rehashed in between, which is why writes are refused during an
+// export.
+size_t SharedMap::export_records(size_t bucket, SharedMap *mask, string &out) {
+  string value;
+  auto add = [&](Entry &entry) {
+    if (entry.type() == TOMBSTONE_TYPE || (mask != NULL && mask->find(entry.key, entry.key_length).found()))
+      return;
+    if (entry.type() == COMPRESSED_TYPE) {
+      char type = Uncompressed(compressor, entry.type(), entry.data(), entry.length(), value);
+      RecordWriter::record(out, entry.key, entry.key_length, type, value.data(), value.size());
+    } else {
+      RecordWriter::record(out, entry.key, entry.key_length, entry.type(), entry.data(), entry.length());
+    }
+  };
+  for (; bucket < buckets() && out.size() < RECORD_STREAM_CHUNK_SIZE; bucket++) {
+    if (flat_map != NULL) {
+      if (flat_map->next(bucket) == bucket) {
+        Entry entry(flat_map, &flat_map->slot(bucket), compressor);
+        add(entry);
+      }
+    } else {
+      for (auto it = property_map->begin(bucket); it != property_map->end(bucket); ++it) {
+        Entry entry(it->first, &it->second, compressor);
+        add(entry);
+      }
+    }
+  }
+  return bucket;
+}
+
+// Call object[name], throwing if it isn't a function.
+static Nan::MaybeLocal<v8::Value> CallMethod(v8::Local<v8::Object> object, const char *name, int argc,
+                                             v8::Local<v8::Value> argv[]) {
+  auto method = Nan::Get(object, Nan::New(name).ToLocalChecked()).ToLocalChecked();
+  if (!method->IsFunction()) {
+    Nan::ThrowTypeError((string(name) + " is not a function.").c_str());
+    return Nan::MaybeLocal<v8::Value>();
+  }
+  return Nan::Call(method.As<v8::Function>(), object, argc, argv);
+}
+
+static bool HasMethod(v8::Local<v8::Value> value, const char *name) {
+  return value->IsObject() &&
+    Nan::Get(Nan::To<v8::Object>(value).ToLocalChecked(), Nan::New(name).ToLocalChecked()).ToLocalChecked()
+    ->IsFunction();
+}
+
+// A function that calls handler with the given pointer as its data.
+static v8::Local<v8::Function> Listener(Nan::FunctionCallback handler, void *data) {
+  auto listener_template = Nan::New<v8::FunctionTemplate>();
+  Nan::SetCallHandler(listener_template, handler, Nan::New<v8::External>(data));
+  return Nan::GetFunction(listener_template).ToLocalChecked();
+}
+
+// Writes the records for everything a reader sees, overlay first, to a
+// writable stream a chunk at a time. When the stream asks for a break,
+// the exporter waits for it to drain. Only a position in the table is
+// kept between chunks, and a write could rehash the table and move
+// entries out from under it, so the object can be read but not written
+// until the export is done. The callback always comes on a later tick,
+// even when the whole export fits in the stream's buffer.
+struct Exporter {
+  Nan::Persistent<v8::Object> object;
+  Nan::Persistent<v8::Object> stream;
+  Nan::Persistent<v8::Function> on_drain;
+  Nan::Persistent<v8::Function> on_error;
+  Nan::Persistent<v8::Function> on_close;
+  Nan::Persistent<v8::Value> result;
+  Nan::Callback *callback;
+  Nan::AsyncResource resource;
+  bool overlay_done;
+  size_t bucket;
+  bool started;
+
+  Exporter(v8::Local<v8::Object> object, v8::Local<v8::Object> stream, v8::Local<v8::Function> callback) :
+    callback(new Nan::Callback(callback)), resource("mmap-object:exportStream"), overlay_done(false), bucket(0),
+    started(false) {
+    this->object.Reset(object);
+    this->stream.Reset(stream);
+    Nan::ObjectWrap::Unwrap<SharedMap>(object)->exporting++;
+    on_drain.Reset(Listener([](const Nan::FunctionCallbackInfo<v8::Value> &info) {
+          static_cast<Exporter *>(info.Data().As<v8::External>()->Value())->pump();
+        }, this));
+    on_error.Reset(Listener([](const Nan::FunctionCallbackInfo<v8::Value> &info) {
+          static_cast<Exporter *>(info.Data().As<v8::External>()->Value())->finish(info[0]);
+        }, this));
+    on_close.Reset(Listener([](const Nan::FunctionCallbackInfo<v8::Value> &info) {
+          static_cast<Exporter *>(info.Data().As<v8::External>()->Value())
+            ->finish(Nan::Error("Stream closed before the export finished."));
+        }, this));
+    v8::Local<v8::Value> error_argv[] = { Nan::New("error").ToLocalChecked(), Nan::New(on_error) };
+    CallMethod(stream, "on", 2, error_argv);
+    v8::Local<v8::Value> close_argv[] = { Nan::New("close").ToLocalChecked(), Nan::New(on_close) };
+    CallMethod(stream, "on", 2, close_argv);
+  }
+  ~Exporter() {
+    delete callback;
+    object.Reset();
+    stream.Reset();
+    on_drain.Reset();
+    on_error.Reset();
+    on_close.Reset();
+    result.Reset();
+  }
+
+  void pump() {
+    Nan::HandleScope scope;
+    auto self = Nan::ObjectWrap::Unwrap<SharedMap>(Nan::New(object));
+    while (true) {
+      if (self->closed) {
+        finish(Nan::Error("Cannot read from closed object."));
+        return;
+      }
+      string chunk;
+      if (!started) {
+        RecordWriter::header(chunk);
+        started = true;
+      }
+      while (chunk.size() < RECORD_STREAM_CHUNK_SIZE) {
+        if (!overlay_done && self->overlay != NULL) {
+          bucket = self->overlay->export_records(bucket, NULL, chunk);
+          if (bucket >= self->overlay->buckets()) {
+            overlay_done = true;
+            bucket = 0;
+          }
+          continue;
+        }
+        overlay_done = true;
+        if (bucket >= self->buckets())
+          break;
+        bucket = self->export_records(bucket, self->overlay, chunk);
+      }
+      if (chunk.empty()) {
+        finish(Nan::Null());
+        return;
+      }
+      v8::Local<v8::Value> argv[] = { Nan::CopyBuffer(chunk.data(), chunk.size()).ToLocalChecked() };
+      v8::Local<v8::Value> more, error;
+      {
+        Nan::TryCatch try_catch;
+        if (!CallMethod(Nan::New(stream), "write", 1, argv).ToLocal(&more))
+          error = try_catch.Exception();
+      }
+      if (!error.IsEmpty()) {
+        finish(error);
+        return;
+      }
+      if (!Nan::To<bool>(more).FromJust()) {
+        v8::Local<v8::Value> argv[] = { Nan::New("drain").ToLocalChecked(), Nan::New(on_drain) };
+        CallMethod(Nan::New(stream), "once", 2, argv);
+        return;
+      }
+    }
+  }
+
+  // Stop listening to the stream, let writes through again and call
+  // back on the next tick.
+  void finish(v8::Local<v8::Value> error) {
+    Nan::ObjectWrap::Unwrap<SharedMap>(Nan::New(object))->exporting--;
+    v8::Local<v8::Value> drain_argv[] = { Nan::New("drain").ToLocalChecked(), Nan::New(on_drain) };
+    CallMethod(Nan::New(stream), "removeListener", 2, drain_argv);
+    v8::Local<v8::Value> error_argv[] = { Nan::New("error").ToLocalChecked(), Nan::New(on_error) };
+    CallMethod(Nan::New(stream), "removeListener", 2, error_argv);
+    v8::Local<v8::Value> close_argv[] = { Nan::New("close").ToLocalChecked(), Nan::New(on_close) };
+    CallMethod(Nan::New(stream), "removeListener", 2, close_argv);
+    result.Reset(error);
+    auto process = Nan::To<v8::Object>(Nan::Get(Nan::GetCurrentContext()->Global(),
+                                                Nan::New("process").ToLocalChecked()).ToLocalChecked())
+      .ToLocalChecked();
+    v8::Local<v8::Value> tick_argv[] = { Listener([](const Nan::FunctionCallbackInfo<v8::Value> &info) {
+          static_cast<Exporter *>(info.Data().As<v8::External>()->Value())->done();
+        }, this) };
+    CallMethod(process, "nextTick", 1, tick_argv);
+  }
+
+  void done() {
+    Nan::HandleScope scope;
+    v8::Local<v8::Value> argv[] = { Nan::New(result) };
+    callback->Call(1, argv, &resource);
+    delete this;
+  }
+};
+
+// Writes the object's contents to a writable stream in the export
+// format and calls back once the stream has taken all of it. Leaves
+// the stream open.
+NAN_METHOD(SharedMap::exportStream) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (!HasMethod(info[0], "write") || !HasMethod(info[0], "on") || !HasMethod(info[0], "once") ||
+      !HasMethod(info[0], "removeListener") || !info[1]->IsFunction()) {
+    Nan::ThrowError("exportStream needs a writable stream and a callback.");
+    return;
+  }
+  if (self->closed) {
+    Nan::ThrowError("Cannot read from closed object.");
+    return;
+  }
+  auto exporter = new Exporter(info.This(), Nan::To<v8::Object>(info[0]).ToLocalChecked(),
+                               info[1].As<v8::Function>());
+  exporter->pump();
+}
+
+// Reads records in the export format from a readable stream and
+// stores them, replacing any entries with the same keys. Each chunk is
+// stored before the next one is taken, which holds back a stream that
+// is faster than the file.
+struct Importer {
+  Nan::Persistent<v8::Object> object;
+  Nan::Persistent<v8::Object> stream;
+  Nan::Persistent<v8::Function> on_data;
+  Nan::Persistent<v8::Function> on_end;
+  Nan::Persistent<v8::Function> on_error;
+  Nan::Persistent<v8::Function> on_close;
+  Nan::Callback *callback;
+  Nan::AsyncResource resource;
+  RecordReader reader;
+
+  Importer(v8::Local<v8::Object> object, v8::Local<v8::Object> stream, v8::Local<v8::Function> callback) :
+    callback(new Nan::Callback(callback)), resource("mmap-object:importStream") {
+    this->object.Reset(object);
+    this->stream.Reset(stream);
+    on_data.Reset(Listener([](const Nan::FunctionCallbackInfo<v8::Value> &info) {
+          static_cast<Importer *>(info.Data().As<v8::External>()->Value())->data(info[0]);
+        }, this));
+    on_end.Reset(Listener([](const Nan::FunctionCallbackInfo<v8::Value> &info) {
+          static_cast<Importer *>(info.Data().As<v8::External>()->Value())->end();
+        }, this));
+    on_error.Reset(Listener([](const Nan::FunctionCallbackInfo<v8::Value> &info) {
+          static_cast<Importer *>(info.Data().As<v8::External>()->Value())->finish(info[0]);
+        }, this));
+    on_close.Reset(Listener([](const Nan::FunctionCallbackInfo<v8::Value> &info) {
+          static_cast<Importer *>(info.Data().As<v8::External>()->Value())
+            ->finish(Nan::Error("Stream closed before it ended."));
+        }, this));
+    listen("on");
+  }
+  ~Importer() {
+    delete callback;
+    object.Reset();
+    stream.Reset();
+    on_data.Reset();
+    on_end.Reset();
+    on_error.Reset();
+    on_close.Reset();
+  }
+
+  // Add or remove all the listeners.
+  void listen(const char *method) {
+    v8::Local<v8::Value> data_argv[] = { Nan::New("data").ToLocalChecked(), Nan::New(on_data) };
+    v8::Local<v8::Value> end_argv[] = { Nan::New("end").ToLocalChecked(), Nan::New(on_end) };
+    v8::Local<v8::Value> error_argv[] = { Nan::New("error").ToLocalChecked(), Nan::New(on_error) };
+    v8::Local<v8::Value> close_argv[] = { Nan::New("close").ToLocalChecked(), Nan::New(on_close) };
+    CallMethod(Nan::New(stream), method, 2, error_argv);
+    CallMethod(Nan::New(stream), method, 2, close_argv);
+    CallMethod(Nan::New(stream), method, 2, end_argv);
+    CallMethod(Nan::New(stream), method, 2, data_argv);
+  }
+
+  void data(v8::Local<v8::Value> chunk) {
+    Nan::HandleScope scope;
+    auto self = Nan::ObjectWrap::Unwrap<SharedMap>(Nan::New(object));
+    if (!node::Buffer::HasInstance(chunk)) {
+      finish(Nan::Error("importStream needs a stream of buffers."));
+      return;
+    }
+    if (self->closed) {
+      finish(Nan::Error("Cannot write to closed object."));
+      return;
+    }
+    if (self->exporting != 0) {
+      finish(Nan::Error("Cannot write to an object during an export."));
+      return;
+    }
+    SharedMap *target = self->overlay != NULL ? self->overlay : self;
+    reader.feed(node::Buffer::Data(chunk), node::Buffer::Length(chunk));
+    Record record;
+    RecordReader::Result result;
+    try {
+      while ((result = reader.next(record)) == RecordReader::RECORD)
+        target->insert(record.key, record.key_length, record.type, record.value, record.value_length);
+    } catch(FileTooLarge &) {
+      finish(Nan::Error("File grew too large."));
+      return;
+    }
+    if (result == RecordReader::CORRUPT)
+      finish(Nan::Error("Corrupt or unsupported record stream."));
+  }
+
+  void end() {
+    if (!reader.complete())
+      finish(Nan::Error("Record stream ended partway through."));
+    else
+      finish(Nan::Null());
+  }
+
+  void finish(v8::Local<v8::Value> error) {
+    listen("removeListener");
+    v8::Local<v8::Value> argv[] = { error };
+    callback->Call(1, argv, &resource);
+    delete this;
+  }
+};
+
+NAN_METHOD(SharedMap::importStream) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (!HasMethod(info[0], "on") || !HasMethod(info[0], "removeListener") || !info[1]->IsFunction()) {
+    Nan::ThrowError("importStream needs a readable stream and a callback.");
+    return;
+  }
+  if (self->readonly) {
+    Nan::ThrowError("Read-only object.");
+    return;
+  }
+  if (self->closed) {
+    Nan::ThrowError("Cannot write to closed object.");
+    return;
+  }
+  if (self->exporting != 0) {
+    Nan::ThrowError("Cannot write to an object during an export.");
+    return;
+  }
+  new Importer(info.This(), Nan::To<v8::Object>(info[0]).ToLocalChecked(), info[1].As<v8::Function>());
+}
+
+// An existing file already in dedup mode stays that way.
+static bool DedupOption(v8::Local<v8::Object> options) {
+  return Nan::To<bool>(Nan::Get(options, Nan::New("dedup").ToLocalChecked()).ToLocalChecked()).FromJust();
+}
+
+// Likewise compression. Either true or the shortest value to compress,
+// where a number of 0 or less means no compression. Returns 0 for no
+// compression.
+static size_t CompressOption(v8::Local<v8::Object> options) {
+  auto compress_option = Nan::Get(options, Nan::New("compress").ToLocalChecked()).ToLocalChecked();
+  if (compress_option->IsNumber())
+    return max(0, Nan::To<int32_t>(compress_option).FromJust());
+  if (Nan::To<bool>(compress_option).FromJust())
+    return DEFAULT_COMPRESS_THRESHOLD;
+  return 0;
+}
+
+// Map the file for writing, creating it with the given version if it
+// doesn't exist yet. With create, a file that already exists is an
+// error rather than opened.
+void SharedMap::map_file(uint32_t new_version, bool create) {
+  if (create)
+    map_seg = new bip::managed_mapped_file(bip::create_only, file_name.c_str(), file_size);
+  else
+    map_seg = new bip::managed_mapped_file(bip::open_or_create, file_name.c_str(), file_size);
+  auto vers = map_seg->find_or_construct<uint32_t>("version")(new_version);
+  if (vers == NULL ) {
+    version = 0;
+  } else {
+    version = *vers;
+  }
+}
+
+// Find the table and settings in a file mapped for writing,
+// constructing whatever isn't there yet.
+void SharedMap::find_tables(size_t initial_bucket_count, bool dedup, size_t compress_threshold) {
+  while (true) { // Make room for a large initial table if need be.
+    try {
+      if (version == FLAT_FILEVERSION) {
+        flat_map = map_seg->find_or_construct<FlatTable>("flat_properties")
+          (initial_bucket_count, map_seg->get_segment_manager());
+      } else {
+        property_map = map_seg->find_or_construct<PropertyHash>("properties")
+          (initial_bucket_count, hasher(), s_equal_to(), map_seg->get_segment_manager());
+      }
+      if (dedup) {
+        interned = map_seg->find_or_construct<InternTable>("interned")(map_seg->get_segment_manager());
+      } else {
+        interned = map_seg->find<InternTable>("interned").first;
+      }
+      if (compress_threshold != 0) {
+        compressor = map_seg->find_or_construct<Compressor>("compression")
+          (compress_threshold, map_seg->get_segment_manager());
+      } else {
+        compressor = map_seg->find<Compressor>("compression").first;
+      }
+      if (interned != NULL || compressor != NULL)
+        mark_cells();
+      break;
+    } catch(bip::bad_alloc &) {
+      grow(file_size);
+    }
+  }
+  closed = false;
+}
+
+// Move a version 1 hash file up to CELLS_FILEVERSION before it holds
+// anything older readers would choke on.
+void SharedMap::mark_cells() {
+  if (version != FILEVERSION && version != ALSOOK)
+    return;
+  *map_seg->find_or_construct<uint32_t>("version")(CELLS_FILEVERSION) = CELLS_FILEVERSION;
+  version = CELLS_FILEVERSION;
+}
+
 NAN_METHOD(SharedMap::Create) {
   if (!info.IsConstructCall()) {
     Nan::ThrowError("Create must be called as a constructor.");
@@ -414,20 +1475,31 @@ NAN_METHOD(SharedMap::Create) {
   if (initial_bucket_count == 0) {
     initial_bucket_count = 1024;
   }
+
+  // Format of a new file. An existing file keeps the format it has.
+  auto options = GetOptions(info);
+  uint32_t new_version = FILEVERSION;
+  auto format = Nan::Get(options, Nan::New("format").ToLocalChecked()).ToLocalChecked();
+  if (!format->IsUndefined()) {
+    string format_name(*Nan::Utf8String(format));
+    if (format_name == "flat") {
+      new_version = FLAT_FILEVERSION;
+    } else if (format_name != "hash") {
+      ostringstream error_stream;
+      error_stream << "Unknown file format " << format_name << ".";
+      Nan::ThrowError(error_stream.str().c_str());
+      return;
+    }
+  }
   SharedMap *d = new SharedMap(*filename, file_size, max_file_size);
 
   try {
-    d->map_seg = new bip::managed_mapped_file(bip::open_or_create, string(*filename).c_str(), file_size);
-    auto vers = d->map_seg->find_or_construct<uint32_t>("version")(FILEVERSION);
-    if (vers == NULL ) {
-      d->version = 0;
-    } else {
-      d->version = *vers;
-    }
+    d->map_file(new_version);
     CHECK_VERSION(d);
-    d->property_map = d->map_seg->find_or_construct<PropertyHash>("properties")
-      (initial_bucket_count, hasher(), s_equal_to(), d->map_seg->get_segment_manager());
-    d->closed = false;
+    d->find_tables(initial_bucket_count, DedupOption(options), CompressOption(options));
+  } catch(FileTooLarge &) {
+    Nan::ThrowError("File grew too large.");
+    return;
   } catch(bip::interprocess_exception &ex){
     ostringstream error_stream;
     error_stream << "Can't open file " << *filename << ": " << ex.what();
@@ -478,14 +1550,21 @@ NAN_METHOD(SharedMap::Open) {
       d->version = *find_version.first;
     }
     CHECK_VERSION(d);
-    auto find_map = d->map_seg->find<PropertyHash>("properties");
-    d->property_map = find_map.first;
-    if (d->property_map == NULL) {
+    bool found;
+    if (d->version == FLAT_FILEVERSION) {
+      d->flat_map = d->map_seg->find<FlatTable>("flat_properties").first;
+      found = d->flat_map != NULL;
+    } else {
+      d->property_map = d->map_seg->find<PropertyHash>("properties").first;
+      found = d->property_map != NULL;
+    }
+    if (!found) {
       ostringstream error_stream;
       error_stream << "File " << *filename << " appears to be corrupt (2).";
       Nan::ThrowError(error_stream.str().c_str());
       return;
     }
+    d->compressor = d->map_seg->find<Compressor>("compression").first;
   } catch(bip::interprocess_exception &ex){
     ostringstream error_stream;
     error_stream << "Can't open file " << *filename << ": " << ex.what();
@@ -493,6 +1572,30 @@ NAN_METHOD(SharedMap::Open) {
     return;
   }
   d->readonly = true;
+
+  // A writable delta file layered over the read-only one, created in
+  // the same format if it doesn't exist yet.
+  auto options = GetOptions(info);
+  auto overlay_option = Nan::Get(options, Nan::New("overlay").ToLocalChecked()).ToLocalChecked();
+  if (!overlay_option->IsUndefined()) {
+    Nan::Utf8String overlay_name(overlay_option);
+    SharedMap *overlay = new SharedMap(*overlay_name, DEFAULT_FILE_SIZE, DEFAULT_MAX_SIZE);
+    try {
+      overlay->map_file(d->version == FLAT_FILEVERSION ? FLAT_FILEVERSION : FILEVERSION);
+      CHECK_VERSION(overlay);
+      overlay->find_tables(1024, DedupOption(options), CompressOption(options));
+    } catch(FileTooLarge &) {
+      Nan::ThrowError("File grew too large.");
+      return;
+    } catch(bip::interprocess_exception &ex){
+      ostringstream error_stream;
+      error_stream << "Can't open file " << *overlay_name << ": " << ex.what();
+      Nan::ThrowError(error_stream.str().c_str());
+      return;
+    }
+    d->overlay = overlay;
+    d->readonly = false;
+  }
   d->closed = false;
   d->Wrap(info.This());
   info.GetReturnValue().Set(info.This());
@@ -505,12 +1608,35 @@ void SharedMap::grow(size_t size) {
   }
   map_seg->flush();
   delete map_seg;
+  // Until the file is mapped again the object is closed, so if growing
+  // or remapping throws nothing is left pointing at the old mapping.
+  map_seg = NULL;
+  closed = true;
   bip::managed_mapped_file::grow(file_name.c_str(), size);
   map_seg = new bip::managed_mapped_file(bip::open_only, file_name.c_str());
-  property_map = map_seg->find<PropertyHash>("properties").first;
+  if (version == FLAT_FILEVERSION)
+    flat_map = map_seg->find<FlatTable>("flat_properties").first;
+  else
+    property_map = map_seg->find<PropertyHash>("properties").first;
+  if (interned != NULL)
+    interned = map_seg->find<InternTable>("interned").first;
+  if (compressor != NULL)
+    compressor = map_seg->find<Compressor>("compression").first;
   closed = false;
 }
 
+// Unmap the file and any overlay, shrinking them to fit first. An
+// overlay that failed to grow is already unmapped.
+void SharedMap::unmap() {
+  if (overlay != NULL && !overlay->closed)
+    overlay->unmap();
+  bip::managed_mapped_file::shrink_to_fit(file_name.c_str());
+  map_seg->flush();
+  delete map_seg;
+  closed = true; // Potentially racy
+  map_seg = NULL;
+}
+
 struct CloseWorker : public Nan::AsyncWorker {
   SharedMap *map;
   CloseWorker(Nan::Callback *&callback, v8::Local<v8::Object> map)
@@ -522,11 +1648,11 @@ struct CloseWorker : public Nan::AsyncWorker {
       SetErrorMessage("Attempted to close a closed object.");
       return;
     }
-    bip::managed_mapped_file::shrink_to_fit(map->file_name.c_str());
-    map->map_seg->flush();
-    delete map->map_seg;
-    map->closed = true; // Potentially racy
-    map->map_seg = NULL;
+    if (map->merging) {
+      SetErrorMessage("Cannot close an object during a merge.");
+      return;
+    }
+    map->unmap();
   }
   friend class SharedMap;
 };
@@ -589,6 +1715,13 @@ v8::Local<v8::Function> SharedMap::init_methods(v8::Local<v8::FunctionTemplate>
   Nan::SetPrototypeMethod(f_tpl, "load_factor", load_factor);
   Nan::SetPrototypeMethod(f_tpl, "max_load_factor", max_load_factor);
   Nan::SetPrototypeMethod(f_tpl, "fileFormatVersion", fileFormatVersion);
+  Nan::SetPrototypeMethod(f_tpl, "dedup", dedup);
+  Nan::SetPrototypeMethod(f_tpl, "compress", compress);
+  Nan::SetPrototypeMethod(f_tpl, "compressed_count", compressed_count);
+  Nan::SetPrototypeMethod(f_tpl, "getAsync", getAsync);
+  Nan::SetPrototypeMethod(f_tpl, "merge", merge);
+  Nan::SetPrototypeMethod(f_tpl, "exportStream", exportStream);
+  Nan::SetPrototypeMethod(f_tpl, "importStream", importStream);
 
   auto proto = f_tpl->PrototypeTemplate();
   Nan::SetNamedPropertyHandler(proto, PropGetter, PropSetter, PropQuery, PropDeleter, PropEnumerator,
@@ -0,0 +1,82 @@
+#include "record_stream.hpp"
+#include "common.hpp"
+
+static void put(string &out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++)
+    out += (char)(value >> (8 * i));
+}
+
+static uint64_t get(const char *data, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++)
+    value |= (uint64_t)(unsigned char)data[i] << (8 * i);
+  return value;
+}
+
+void RecordWriter::header(string &out) {
+  out.append(RECORD_STREAM_MAGIC, 4);
+  put(out, RECORD_STREAM_VERSION, 4);
+}
+
+void RecordWriter::record(string &out, const char *key, size_t key_length, char type, const char *value,
+                          size_t value_length) {
+  put(out, key_length, 4);
+  out.append(key, key_length);
+  out += type;
+  put(out, value_length, 8);
+  if (type == NUMBER_TYPE) {
+    uint64_t bits;
+    memcpy(&bits, value, sizeof(bits));
+    put(out, bits, 8);
+  } else {
+    out.append(value, value_length);
+  }
+}
+
+// Drop what's been parsed before taking on more, so pending only ever
+// holds about one chunk and one partial record.
+void RecordReader::feed(const char *data, size_t length) {
+  pending.erase(0, position);
+  position = 0;
+  pending.append(data, length);
+}
+
+RecordReader::Result RecordReader::next(Record &record) {
+  const char *data = pending.data() + position;
+  size_t available = pending.size() - position;
+  if (!header_read) {
+    if (available < RECORD_STREAM_HEADER_SIZE)
+      return memcmp(data, RECORD_STREAM_MAGIC, min(available, (size_t)4)) == 0 ? MORE : CORRUPT;
+    if (memcmp(data, RECORD_STREAM_MAGIC, 4) != 0 || get(data + 4, 4) > RECORD_STREAM_VERSION)
+      return CORRUPT;
+    header_read = true;
+    position += RECORD_STREAM_HEADER_SIZE;
+    return next(record);
+  }
+
+  if (available < 4)
+    return MORE;
+  uint64_t key_length = get(data, 4);
+  if (available < 4 + key_length + 9)
+    return MORE;
+  char type = data[4 + key_length];
+  uint64_t value_length = get(data + 4 + key_length + 1, 8);
+  if ((type != STRING_TYPE && type != NUMBER_TYPE && type != BUFFER_TYPE) ||
+      (type == NUMBER_TYPE && value_length != sizeof(double)))
+    return CORRUPT;
+  if (available - (4 + key_length + 9) < value_length)
+    return MORE;
+
+  record.key = data + 4;
+  record.key_length = key_length;
+  record.type = type;
+  record.value = data + 4 + key_length + 9;
+  record.value_length = value_length;
+  if (type == NUMBER_TYPE) {
+    uint64_t bits = get(record.value, 8);
+    memcpy(&record.number, &bits, sizeof(bits));
+    record.value = reinterpret_cast<const char *>(&record.number);
+  }
+  position += 4 + key_length + 9 + value_length;
+  return RECORD;
+}
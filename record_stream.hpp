@@ -0,0 +1,52 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "cell.hpp"
+
+// The export format. A header of RECORD_STREAM_MAGIC and the format
+// version as a 32-bit integer, then one record per entry: key length
+// (32 bits), key, type (8 bits: STRING_TYPE, NUMBER_TYPE or
+// BUFFER_TYPE), value length (64 bits), value. Integers and numbers
+// are little-endian, and values are never compressed, so a stream
+// doesn't depend on the machine or the settings of the file it came
+// from.
+#define RECORD_STREAM_MAGIC "mmos"
+#define RECORD_STREAM_VERSION 1
+#define RECORD_STREAM_HEADER_SIZE 8
+#define RECORD_STREAM_CHUNK_SIZE (64ul<<10) // Records are exported in chunks of about this many bytes
+
+struct Record {
+  const char *key;
+  size_t key_length;
+  char type;
+  const char *value;
+  size_t value_length;
+  double number; // The value of a NUMBER_TYPE record, which value points at
+};
+
+class RecordWriter {
+public:
+  static void header(string &out);
+  static void record(string &out, const char *key, size_t key_length, char type, const char *value,
+                     size_t value_length);
+};
+
+// Parses records out of a stream that arrives in pieces of any size.
+class RecordReader {
+private:
+  string pending;
+  size_t position; // Start of the first unparsed byte in pending
+  bool header_read;
+public:
+  enum Result { RECORD, MORE, CORRUPT };
+  RecordReader() : position(0), header_read(false) {}
+
+  void feed(const char *data, size_t length);
+  // Parse the next whole record. It points into the reader and is good
+  // until the next call to feed.
+  Result next(Record &record);
+  // Whether the stream so far ends cleanly between records.
+  bool complete() const { return header_read && position == pending.size(); }
+};
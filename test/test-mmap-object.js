@@ -11,6 +11,7 @@ const fs = require('fs')
 const os = require('os')
 const which = require('which')
 const async = require('async')
+const stream = require('stream')
 
 const BigKeySize = 1000
 const BiggerKeySize = 10000
@@ -19,7 +20,8 @@ const methods = [
   'isClosed', 'isOpen', 'close', 'valueOf', 'toString',
   'close', 'get_free_memory', 'get_size', 'bucket_count',
   'max_bucket_count', 'load_factor', 'max_load_factor',
-  'propertyIsEnumerable'
+  'propertyIsEnumerable', 'fileFormatVersion', 'dedup', 'compress',
+  'compressed_count', 'getAsync', 'merge', 'exportStream', 'importStream'
 ]
 
 describe('mmap-object', function () {
@@ -415,6 +417,7 @@ describe('mmap-object', function () {
 
       expect(this.reader.isData(this.reader.close)).to.be.false
       expect(this.reader.isData('close')).to.be.false
+      expect(this.reader.isData('compressed_count')).to.be.false
 
       expect(this.reader.isData('')).to.be.true
       expect(this.reader.isData()).to.be.true
@@ -439,6 +442,654 @@ describe('mmap-object', function () {
     })
   })
 
+  describe('Flat format', function () {
+    before(function () {
+      this.testfile = path.join(this.dir, 'flattest')
+      const writer = new MmapObject.Create(this.testfile, { format: 'flat' })
+      writer['first'] = 'value for first'
+      writer['second'] = 0.207879576
+      writer['buffer'] = Buffer.from([0x62, 0x0, 0x66, 0x66, 0x65, 0x72])
+      writer['nul'] = 'before\u0000after'
+      this.bigKey = new Array(BigKeySize).join('fourty-nine thousand nine hundred fifty bytes long')
+      this.bigValue = new Array(BiggerKeySize).join('six hundred seventy nine thousand nine hundred thirty two bytes long')
+      writer[this.bigKey] = this.bigValue
+      writer['samekey'] = 'first value'
+      writer['samekey'] = writer['samekey'] + ' and a new value too'
+      writer.should_be_deleted = 'I should not exist!'
+      delete writer.should_be_deleted
+      writer.close()
+      this.reader = new MmapObject.Open(this.testfile)
+    })
+
+    after(function () {
+      this.reader.close()
+    })
+
+    it('has fileFormatVersion', function () {
+      expect(this.reader.fileFormatVersion()).to.equal(2)
+    })
+
+    it('reads short and long values', function () {
+      expect(this.reader.first).to.equal('value for first')
+      expect(this.reader.second).to.equal(0.207879576)
+      expect(this.reader.buffer).to.deep.equal(Buffer.from([0x62, 0x0, 0x66, 0x66, 0x65, 0x72]))
+      expect(this.reader[this.bigKey]).to.equal(this.bigValue)
+      expect(this.reader.samekey).to.equal('first value and a new value too')
+    })
+
+    it('keeps strings with embedded NULs', function () {
+      expect(this.reader.nul).to.equal('before\u0000after')
+    })
+
+    it('can get keys', function () {
+      expect(this.reader).to.have.keys(['first', 'second', 'buffer', 'nul', this.bigKey, 'samekey'])
+    })
+
+    it('implements the iterator protocol', function () {
+      let count = 0
+      for (let [key, value] of this.reader) {
+        expect(this.reader[key]).to.deep.equal(value)
+        count++
+      }
+      expect(count).to.equal(6)
+    })
+
+    it('keeps the format of an existing file', function () {
+      const obj = new MmapObject.Create(this.testfile)
+      expect(obj.fileFormatVersion()).to.equal(2)
+      expect(obj.first).to.equal('value for first')
+      obj.close()
+    })
+
+    it('grows the table and the file', function () {
+      const obj = new MmapObject.Create(path.join(this.dir, 'flatgrow'), 2, 2, 0, { format: 'flat' })
+      expect(obj.bucket_count()).to.equal(16)
+      for (let i = 0; i < 5000; i++) {
+        obj[`key${i}`] = `value${i}`
+      }
+      for (let i = 0; i < 5000; i += 2) {
+        delete obj[`key${i}`]
+      }
+      expect(obj.bucket_count()).to.equal(8192)
+      expect(obj.load_factor()).to.be.below(obj.max_load_factor())
+      for (let i = 0; i < 5000; i++) {
+        expect(obj[`key${i}`]).to.equal(i % 2 ? `value${i}` : undefined)
+      }
+      obj.close()
+    })
+
+    for (let count of [29000, 1000000]) {
+      it(`makes smaller files than the hash format when presized for ${count} keys`, function () {
+        this.timeout(60000)
+        const sizes = {}
+        for (let format of ['hash', 'flat']) {
+          const filename = path.join(this.dir, `presized-${format}-${count}`)
+          // Room for either format up front, so neither grows a little at a time
+          const writer = new MmapObject.Create(filename, count / 5, count, 0, { format: format })
+          for (let i = 0; i < count; i++) {
+            writer[`key${i}`] = `value${i}`
+          }
+          writer.close()
+          const reader = new MmapObject.Open(filename)
+          sizes[format] = reader.get_size()
+          expect(reader[`key${count - 1}`]).to.equal(`value${count - 1}`)
+          reader.close()
+          fs.unlinkSync(filename)
+        }
+        expect(sizes.flat).to.be.below(sizes.hash * 0.8)
+      })
+    }
+
+    it('moves hash files up to version 3 for cells version 1 lacks', function () {
+      const file = name => path.join(this.dir, `cells-${name}`)
+      const plain = new MmapObject.Create(file('plain'))
+      expect(plain.fileFormatVersion()).to.equal(1)
+      plain.dedup()
+      expect(plain.fileFormatVersion()).to.equal(3)
+      plain.close()
+      for (let options of [{ dedup: true }, { compress: true }]) {
+        const name = Object.keys(options)[0]
+        const writer = new MmapObject.Create(file(name), options)
+        expect(writer.fileFormatVersion()).to.equal(3)
+        writer.close()
+        const reader = new MmapObject.Open(file(name))
+        expect(reader.fileFormatVersion()).to.equal(3)
+        reader.close()
+      }
+      const flat = new MmapObject.Create(file('flat'), { format: 'flat', dedup: true })
+      expect(flat.fileFormatVersion()).to.equal(2)
+      flat.close()
+
+      const base = new MmapObject.Create(file('base'))
+      base.gone = 'gone'
+      base.close()
+      const layered = new MmapObject.Open(file('base'), { overlay: file('base.delta') })
+      delete layered.gone
+      layered.close()
+      const delta = new MmapObject.Open(file('base.delta'))
+      expect(delta.fileFormatVersion()).to.equal(3)
+      delta.close()
+    })
+
+    it('throws on an unknown format', function () {
+      const dir = this.dir
+      expect(function () {
+        const obj = new MmapObject.Create(path.join(dir, 'badformat'), { format: 'round' })
+        expect(obj).to.not.exist
+      }).to.throw(/Unknown file format round./)
+    })
+  })
+
+  describe('Dedup', function () {
+    const repeated = new Array(BigKeySize).join('a repeated value')
+
+    for (let format of ['hash', 'flat']) {
+      it(`shares repeated values in ${format} files`, function () {
+        const plain = new MmapObject.Create(path.join(this.dir, `plain-${format}`), { format: format })
+        const deduped = new MmapObject.Create(path.join(this.dir, `dedup-${format}`), { format: format, dedup: true })
+        const plainInitial = plain.get_free_memory()
+        const dedupedInitial = deduped.get_free_memory()
+        for (let i = 0; i < 100; i++) {
+          plain[`key${i}`] = repeated
+          deduped[`key${i}`] = repeated
+        }
+        const plainUsed = plainInitial - plain.get_free_memory()
+        const dedupedUsed = dedupedInitial - deduped.get_free_memory()
+        expect(dedupedUsed).to.be.below(plainUsed / 10)
+        plain.close()
+        deduped.close()
+      })
+
+      it(`keeps shared values until the last reference goes in ${format} files`, function () {
+        const filename = path.join(this.dir, `refs-${format}`)
+        const writer = new MmapObject.Create(filename, { format: format, dedup: true })
+        writer.one = repeated
+        writer.two = repeated
+        writer.three = Buffer.from(repeated)
+        delete writer.one
+        writer.two = 'short'
+        expect(writer.three).to.deep.equal(Buffer.from(repeated))
+        writer.four = repeated
+        writer.close()
+        const reader = new MmapObject.Open(filename)
+        expect(reader.two).to.equal('short')
+        expect(reader.three).to.deep.equal(Buffer.from(repeated))
+        expect(reader.four).to.equal(repeated)
+        reader.close()
+      })
+
+      it(`doesn't let changes to a shared buffer leak between keys in ${format} files`, function () {
+        const writer = new MmapObject.Create(path.join(this.dir, `alias-${format}`), { format: format, dedup: true })
+        writer.a = writer.b = Buffer.from(repeated)
+        const a = writer.a
+        a[0] = 0x21
+        expect(writer.b).to.deep.equal(Buffer.from(repeated))
+        expect(writer.a).to.deep.equal(Buffer.from(repeated))
+        writer.c = Buffer.from(repeated)
+        writer.close()
+      })
+
+      it(`dedups existing ${format} files`, function () {
+        const filename = path.join(this.dir, `later-${format}`)
+        const writer = new MmapObject.Create(filename, { format: format })
+        for (let i = 0; i < 100; i++) {
+          writer[`key${i}`] = repeated
+        }
+        writer.close()
+        const rewriter = new MmapObject.Create(filename)
+        expect(rewriter.dedup()).to.be.above(repeated.length * 90)
+        rewriter.key100 = repeated
+        rewriter.close()
+        const reader = new MmapObject.Open(filename)
+        for (let i = 0; i <= 100; i++) {
+          expect(reader[`key${i}`]).to.equal(repeated)
+        }
+        expect(function () {
+          reader.dedup()
+        }).to.throw(/Read-only object./)
+        reader.close()
+      })
+    }
+  })
+
+  describe('Compression', function () {
+    const record = i => JSON.stringify({
+      id: i,
+      name: `customer number ${i}`,
+      status: ['active', 'suspended', 'pending'][i % 3],
+      notes: 'Account opened through the partner program. Billing contact confirmed by phone.'
+    })
+    const long = new Array(BigKeySize).join('a compressible value ')
+
+    for (let format of ['hash', 'flat']) {
+      it(`compresses long values in ${format} files`, function () {
+        const filename = path.join(this.dir, `compressed-${format}`)
+        const plain = new MmapObject.Create(path.join(this.dir, `uncompressed-${format}`), { format: format })
+        const compressed = new MmapObject.Create(filename, { format: format, compress: true })
+        const plainInitial = plain.get_free_memory()
+        const compressedInitial = compressed.get_free_memory()
+        plain.long = compressed.long = long
+        plain.buffer = compressed.buffer = Buffer.from(long)
+        compressed.short = 'short'
+        compressed.number = 12.5
+        expect(compressedInitial - compressed.get_free_memory()).to.be.below((plainInitial - plain.get_free_memory()) / 10)
+        expect(compressed.long).to.equal(long)
+        expect(compressed.compressed_count()).to.equal(2)
+        expect(plain.compressed_count()).to.equal(0)
+        plain.close()
+        compressed.close()
+        const reader = new MmapObject.Open(filename)
+        expect(reader.long).to.equal(long)
+        expect(reader.buffer).to.deep.equal(Buffer.from(long))
+        expect(reader.short).to.equal('short')
+        expect(reader.number).to.equal(12.5)
+        expect(reader.compressed_count()).to.equal(2)
+        reader.close()
+      })
+
+      it(`doesn't compress ${format} files with a minimum length of 0`, function () {
+        for (let compress of [0, -1]) {
+          const writer = new MmapObject.Create(path.join(this.dir, `uncompressed-${format}${compress}`),
+                                               { format: format, compress: compress })
+          writer.long = long
+          expect(writer.compressed_count()).to.equal(0)
+          writer.close()
+        }
+      })
+
+      it(`trains a dictionary for ${format} files`, function () {
+        const filename = path.join(this.dir, `trained-${format}`)
+        const writer = new MmapObject.Create(filename, { format: format, compress: 64 })
+        for (let i = 0; i < 500; i++) {
+          writer[`key${i}`] = record(i)
+        }
+        expect(writer.compress()).to.be.above(0)
+        writer.key500 = record(500)
+        writer.close()
+        const reader = new MmapObject.Open(filename)
+        for (let i = 0; i <= 500; i++) {
+          expect(reader[`key${i}`]).to.equal(record(i))
+        }
+        expect(function () {
+          reader.compress()
+        }).to.throw(/Read-only object./)
+        reader.close()
+      })
+
+      it(`compresses shared values in ${format} files`, function () {
+        const filename = path.join(this.dir, `compressed-dedup-${format}`)
+        const writer = new MmapObject.Create(filename, { format: format, compress: true, dedup: true })
+        writer.one = long
+        writer.two = long
+        delete writer.one
+        writer.close()
+        const reader = new MmapObject.Open(filename)
+        expect(reader.two).to.equal(long)
+        reader.close()
+      })
+
+      it(`gets values asynchronously from ${format} files`, function (done) {
+        const writer = new MmapObject.Create(path.join(this.dir, `async-${format}`), { format: format, compress: true })
+        writer.long = long
+        writer.buffer = Buffer.from(long)
+        writer.short = 'short'
+        writer.number = 12.5
+        const expected = { long: long, buffer: Buffer.from(long), short: 'short', number: 12.5, missing: undefined }
+        let pending = Object.keys(expected).length
+        for (let key of Object.keys(expected)) {
+          writer.getAsync(key, function (err, value) {
+            expect(err).to.be.null
+            expect(value).to.deep.equal(expected[key])
+            if (--pending === 0) {
+              writer.close()
+              done()
+            }
+          })
+        }
+      })
+    }
+  })
+
+  describe('Overlay', function () {
+    let count = 0
+    for (let format of ['hash', 'flat']) {
+      describe(`over a ${format} base`, function () {
+        beforeEach(function () {
+          this.base = path.join(this.dir, `base-${format}-${count++}`)
+          this.delta = `${this.base}.delta`
+          const writer = new MmapObject.Create(this.base, { format: format })
+          writer.kept = 'from the base'
+          writer.replaced = 'old value'
+          writer.deleted = 'doomed'
+          writer.number = 1
+          writer.close()
+        })
+
+        it(`layers writes over a read-only ${format} base`, function () {
+          const obj = new MmapObject.Open(this.base, { overlay: this.delta })
+          obj.replaced = 'new value'
+          obj.added = Buffer.from('added')
+          obj.number = 2
+          delete obj.deleted
+          expect(obj.kept).to.equal('from the base')
+          expect(obj.replaced).to.equal('new value')
+          expect(obj.added).to.deep.equal(Buffer.from('added'))
+          expect(obj.number).to.equal(2)
+          expect(obj.deleted).to.be.undefined
+          expect(Object.keys(obj).sort()).to.deep.equal(['added', 'kept', 'number', 'replaced'])
+          expect(new Map(obj).get('replaced')).to.equal('new value')
+          expect(Array.from(obj).length).to.equal(4)
+          obj.close()
+
+          const base = new MmapObject.Open(this.base)
+          expect(base.replaced).to.equal('old value')
+          expect(base.deleted).to.equal('doomed')
+          expect(base.added).to.be.undefined
+          base.close()
+        })
+
+        it(`keeps changes in the ${format} delta file`, function () {
+          const writer = new MmapObject.Open(this.base, { overlay: this.delta })
+          delete writer.deleted
+          writer.added = 'added'
+          delete writer.added
+          writer.readded = 'temporary'
+          delete writer.readded
+          writer.readded = 'back again'
+          writer.close()
+          const reader = new MmapObject.Open(this.base, { overlay: this.delta })
+          expect(reader.deleted).to.be.undefined
+          expect(reader.added).to.be.undefined
+          expect(reader.readded).to.equal('back again')
+          expect(Object.keys(reader).sort()).to.deep.equal(['kept', 'number', 'readded', 'replaced'])
+          reader.close()
+        })
+
+        it(`merges the overlay into a new ${format} base`, function (done) {
+          const obj = new MmapObject.Open(this.base, { overlay: this.delta })
+          obj.replaced = 'new value'
+          obj.added = 'added'
+          delete obj.deleted
+          const merged = `${this.base}.merged`
+          obj.merge(merged, err => {
+            expect(err).to.not.exist
+            obj.after = 'not merged'
+            obj.close()
+            const reader = new MmapObject.Open(merged)
+            expect(reader.fileFormatVersion()).to.equal(format === 'flat' ? 2 : 1)
+            expect(Object.keys(reader).sort()).to.deep.equal(['added', 'kept', 'number', 'replaced'])
+            expect(reader.replaced).to.equal('new value')
+            expect(reader.number).to.equal(1)
+            reader.close()
+            // Writes after merge() are kept by layering the delta over the new base
+            const layered = new MmapObject.Open(merged, { overlay: this.delta })
+            expect(layered.after).to.equal('not merged')
+            expect(layered.replaced).to.equal('new value')
+            expect(layered.deleted).to.be.undefined
+            layered.close()
+            done()
+          })
+          expect(function () {
+            obj.close()
+          }).to.throw(/during a merge/)
+        })
+      })
+    }
+
+    it('layers an existing delta of the other format', function () {
+      const longKey = 'a key too long to be stored in its slot'
+      const base = path.join(this.dir, 'mixed-base')
+      const writer = new MmapObject.Create(base, { format: 'flat' })
+      writer[longKey] = 'old'
+      writer.other = 'other'
+      writer.close()
+      const delta = new MmapObject.Create(`${base}.delta`, { format: 'hash' })
+      delta[longKey] = 'new'
+      delta.close()
+      const obj = new MmapObject.Open(base, { overlay: `${base}.delta` })
+      expect(obj[longKey]).to.equal('new')
+      expect(Object.keys(obj).sort()).to.deep.equal([longKey, 'other'])
+      expect(Array.from(obj).length).to.equal(2)
+      obj.close()
+    })
+
+    it('keeps compressed values when merging', function (done) {
+      const long = new Array(BigKeySize).join('a compressible value ')
+      const base = path.join(this.dir, 'compressed-base')
+      const writer = new MmapObject.Create(base, { compress: true })
+      writer.long = long
+      writer.compress()
+      writer.close()
+      const obj = new MmapObject.Open(base, { overlay: `${base}.delta`, compress: true })
+      obj.other = long + long
+      const merged = `${base}.merged`
+      obj.merge(merged, err => {
+        expect(err).to.not.exist
+        obj.close()
+        const reader = new MmapObject.Open(merged)
+        expect(reader.long).to.equal(long)
+        expect(reader.other).to.equal(long + long)
+        reader.close()
+        done()
+      })
+    })
+
+    it('refuses to merge into an existing file or from a writer', function () {
+      const filename = path.join(this.dir, 'merge-writer')
+      const writer = new MmapObject.Create(filename)
+      expect(function () {
+        writer.merge(path.join(this.dir, 'merge-out'), function () {})
+      }.bind(this)).to.throw(/Only objects from Open can be merged/)
+      writer.close()
+      const reader = new MmapObject.Open(filename)
+      expect(function () {
+        reader.merge(filename, function () {})
+      }).to.throw(/already exists/)
+      reader.close()
+    })
+  })
+
+  describe('Streams', function () {
+    const long = new Array(BigKeySize).join('a long value ')
+
+    // A writable stream that takes its time, so the exporter has to
+    // wait for it to drain.
+    function slowSink (chunks) {
+      return new stream.Writable({
+        highWaterMark: 1024,
+        write (chunk, encoding, callback) {
+          chunks.push(chunk)
+          setImmediate(callback)
+        }
+      })
+    }
+
+    function readable (chunks) {
+      const input = new stream.PassThrough()
+      for (const chunk of chunks) {
+        input.write(chunk)
+      }
+      input.end()
+      return input
+    }
+
+    function fill (obj) {
+      for (let i = 0; i < 2000; i++) {
+        obj[`key${i}`] = i % 3 ? `value ${i}` : long + i
+      }
+      obj.number = 12.5
+      obj.buffer = Buffer.from(long)
+    }
+
+    function check (obj) {
+      for (let i = 0; i < 2000; i++) {
+        expect(obj[`key${i}`]).to.equal(i % 3 ? `value ${i}` : long + i)
+      }
+      expect(obj.number).to.equal(12.5)
+      expect(obj.buffer).to.deep.equal(Buffer.from(long))
+      expect(Object.keys(obj).length).to.equal(2002)
+    }
+
+    for (let [from, to] of [['hash', 'flat'], ['flat', 'hash']]) {
+      it(`copies a ${from} file into a ${to} file`, function (done) {
+        const source = new MmapObject.Create(path.join(this.dir, `export-${from}`),
+                                             { format: from, compress: true, dedup: true })
+        fill(source)
+        const chunks = []
+        const sink = slowSink(chunks)
+        source.exportStream(sink, err => {
+          expect(err).to.not.exist
+          source.close()
+          const target = new MmapObject.Create(path.join(this.dir, `import-${to}`), { format: to })
+          const input = new stream.PassThrough()
+          target.importStream(input, err => {
+            expect(err).to.not.exist
+            check(target)
+            target.close()
+            done()
+          })
+          for (const chunk of chunks) {
+            input.write(chunk.slice(0, 7))
+            input.write(chunk.slice(7))
+          }
+          input.end()
+        })
+      })
+    }
+
+    it('exports what an overlay shows', function (done) {
+      const base = path.join(this.dir, 'export-base')
+      const writer = new MmapObject.Create(base)
+      writer.kept = 'kept'
+      writer.replaced = 'old'
+      writer.deleted = 'deleted'
+      writer.close()
+      const obj = new MmapObject.Open(base, { overlay: `${base}.delta` })
+      obj.replaced = 'new'
+      obj.added = 'added'
+      delete obj.deleted
+      const chunks = []
+      obj.exportStream(slowSink(chunks), err => {
+        expect(err).to.not.exist
+        obj.close()
+        const target = new MmapObject.Create(path.join(this.dir, 'export-overlay-copy'))
+        target.importStream(readable(chunks), err => {
+          expect(err).to.not.exist
+          expect(Object.keys(target).sort()).to.deep.equal(['added', 'kept', 'replaced'])
+          expect(target.replaced).to.equal('new')
+          target.close()
+          done()
+        })
+      })
+    })
+
+    it('calls back from an export asynchronously', function (done) {
+      const obj = new MmapObject.Create(path.join(this.dir, 'export-small'))
+      obj.key = 'value'
+      let returned = false
+      obj.exportStream(new stream.PassThrough(), err => {
+        expect(err).to.not.exist
+        expect(returned).to.be.true
+        obj.close()
+        done()
+      })
+      returned = true
+    })
+
+    it('refuses writes until an export is done', function (done) {
+      const obj = new MmapObject.Create(path.join(this.dir, 'export-busy'))
+      fill(obj)
+      const chunks = []
+      obj.exportStream(slowSink(chunks), err => {
+        expect(err).to.not.exist
+        obj.after = 'after'
+        expect(obj.after).to.equal('after')
+        obj.close()
+        done()
+      })
+      expect(obj.key1).to.equal('value 1')
+      expect(function () {
+        obj.during = 'during'
+      }).to.throw(/Cannot write to an object during an export./)
+      expect(function () {
+        delete obj.key1
+      }).to.throw(/Cannot delete from an object during an export./)
+      expect(function () {
+        obj.importStream(new stream.PassThrough(), function () {})
+      }).to.throw(/Cannot write to an object during an export./)
+    })
+
+    it('stops an export when the stream closes', function (done) {
+      const obj = new MmapObject.Create(path.join(this.dir, 'export-closed'))
+      fill(obj)
+      const sink = slowSink([])
+      obj.exportStream(sink, err => {
+        expect(err.message).to.match(/Stream closed before the export finished/)
+        obj.close()
+        done()
+      })
+      sink.destroy()
+    })
+
+    it('stops an import when the stream closes', function (done) {
+      const target = new MmapObject.Create(path.join(this.dir, 'import-closed'))
+      const input = new stream.PassThrough()
+      target.importStream(input, err => {
+        expect(err.message).to.match(/Stream closed before it ended/)
+        target.close()
+        done()
+      })
+      input.destroy()
+    })
+
+    it('needs streams with the methods it calls', function () {
+      const obj = new MmapObject.Create(path.join(this.dir, 'export-not-a-stream'))
+      expect(function () {
+        obj.exportStream({ write () { return true } }, function () {})
+      }).to.throw(/exportStream needs a writable stream and a callback./)
+      expect(function () {
+        obj.importStream({ on () {} }, function () {})
+      }).to.throw(/importStream needs a readable stream and a callback./)
+      obj.close()
+    })
+
+    it('rejects a stream that is not an export', function (done) {
+      const target = new MmapObject.Create(path.join(this.dir, 'import-corrupt'))
+      target.importStream(readable([Buffer.from('not an export at all')]), err => {
+        expect(err.message).to.match(/Corrupt or unsupported record stream/)
+        target.close()
+        done()
+      })
+    })
+
+    it('rejects a stream that stops partway through a record', function (done) {
+      const source = new MmapObject.Create(path.join(this.dir, 'export-truncated'))
+      source.key = 'value'
+      const chunks = []
+      source.exportStream(slowSink(chunks), err => {
+        expect(err).to.not.exist
+        source.close()
+        const whole = Buffer.concat(chunks)
+        const target = new MmapObject.Create(path.join(this.dir, 'import-truncated'))
+        target.importStream(readable([whole.slice(0, whole.length - 1)]), err => {
+          expect(err.message).to.match(/ended partway through/)
+          target.close()
+          done()
+        })
+      })
+    })
+
+    it('will not import into a read-only object', function () {
+      const filename = path.join(this.dir, 'import-readonly')
+      new MmapObject.Create(filename).close()
+      const reader = new MmapObject.Open(filename)
+      expect(function () {
+        reader.importStream(new stream.PassThrough(), function () {})
+      }).to.throw(/Read-only object./)
+      reader.close()
+    })
+  })
+
   describe('Object comparison', function () {
     before(function () {
       const testfile1 = path.join(this.dir, 'prototest1')